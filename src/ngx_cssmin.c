@@ -37,9 +37,17 @@
  * SOFTWARE.
  */
 
+/*
+ * cssmin() can be suspended at any buffer boundary: when machine() needs to
+ * peek past the end of the current buffer, the character it was working on
+ * is kept in ctx->pending and replayed once the next buffer arrives.
+ */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <ngx_config.h>
 #include <ngx_core.h>
+#include "ngx_cssmin.h"
 
 #define STATE_FREE 1
 #define STATE_ATRULE 2
@@ -48,26 +56,33 @@
 #define STATE_DECLARATION 5
 #define STATE_COMMENT 6
 
-static int theLookahead = EOF, tmp_state, state = 1, in_paren = 0;
-
-static int ngx_getc(ngx_buf_t *in)
+static int ngx_getc(ngx_cssmin_ctx_t *ctx, ngx_buf_t *in)
 {
     if (in->pos >= in->last)
     {
-        return EOF;
+        return ctx->last ? EOF : NGX_CSSMIN_AGAIN;
     }
     u_char c = in->pos[0];
     ++in->pos;
     return c;
 }
 
-static void ngx_putc(u_char c, ngx_buf_t *out)
+/* in place the output shares memory with the input and stays behind it */
+
+static u_char *ngx_out_end(ngx_cssmin_ctx_t *ctx, ngx_buf_t *out)
 {
-    if (out->pos <= out->end)
+    return ctx->in_place ? ctx->in->pos : out->end;
+}
+
+static void ngx_putc(ngx_cssmin_ctx_t *ctx, u_char c, ngx_buf_t *out)
+{
+    if (ctx->ncarry == 0 && out->last < ngx_out_end(ctx, out))
     {
-        out->pos[0] = c;
-        ++out->pos;
+        out->last[0] = c;
+        ++out->last;
+        return;
     }
+    ctx->carry[ctx->ncarry++] = c;
 }
 
 /* get -- return the next character from in. Watch out for lookahead. If
@@ -75,16 +90,16 @@ static void ngx_putc(u_char c, ngx_buf_t *out)
  * linefeed.
  */
 
-static int get(ngx_buf_t *in)
+static int get(ngx_cssmin_ctx_t *ctx, ngx_buf_t *in)
 {
-    int c = theLookahead;
-    theLookahead = EOF;
+    int c = ctx->theLookahead;
+    ctx->theLookahead = EOF;
     if (c == EOF)
     {
-        c = ngx_getc(in);
+        c = ngx_getc(ctx, in);
     }
 
-    if (c >= ' ' || c == '\n' || c == EOF)
+    if (c >= ' ' || c == '\n' || c == EOF || c == NGX_CSSMIN_AGAIN)
     {
         return c;
     }
@@ -101,28 +116,42 @@ static int get(ngx_buf_t *in)
  * peek -- get the next character without getting it.
  */
 
-static int peek(ngx_buf_t *in)
+static int peek(ngx_cssmin_ctx_t *ctx, ngx_buf_t *in)
 {
-    theLookahead = get(in);
-    return theLookahead;
+    int c = get(ctx, in);
+    if (c != NGX_CSSMIN_AGAIN)
+    {
+        ctx->theLookahead = c;
+    }
+    return c;
 }
 
 /* 
  *machine
+ *
+ * returns NGX_CSSMIN_AGAIN if a peek ran out of input; the state changes
+ * made before every peek are idempotent, so c is simply fed again later.
  */
 
-static int machine(int c, ngx_buf_t *in)
+static int machine(ngx_cssmin_ctx_t *ctx, int c, ngx_buf_t *in)
 {
-    if (state != STATE_COMMENT)
+    int p;
+
+    if (ctx->state != STATE_COMMENT && c == '/')
     {
-        if (c == '/' && peek(in) == '*')
+        p = peek(ctx, in);
+        if (p == NGX_CSSMIN_AGAIN)
         {
-            tmp_state = state;
-            state = STATE_COMMENT;
+            return p;
+        }
+        if (p == '*')
+        {
+            ctx->tmp_state = ctx->state;
+            ctx->state = STATE_COMMENT;
         }
     }
 
-    switch (state)
+    switch (ctx->state)
     {
     case STATE_FREE:
         if (c == ' ' && c == '\n')
@@ -131,17 +160,20 @@ static int machine(int c, ngx_buf_t *in)
         }
         else if (c == '@')
         {
-            state = STATE_ATRULE;
+            ctx->state = STATE_ATRULE;
             break;
         }
         else if (c > 0)
         {
-            state = STATE_SELECTOR;
+            ctx->state = STATE_SELECTOR;
         }
+
+        /* fall through */
+
     case STATE_SELECTOR:
         if (c == '{')
         {
-            state = STATE_BLOCK;
+            ctx->state = STATE_BLOCK;
         }
         else if (c == '\n')
         {
@@ -149,11 +181,19 @@ static int machine(int c, ngx_buf_t *in)
         }
         else if (c == '@')
         {
-            state = STATE_ATRULE;
+            ctx->state = STATE_ATRULE;
         }
-        else if (c == ' ' && peek(in) == '{')
+        else if (c == ' ')
         {
-            c = 0;
+            p = peek(ctx, in);
+            if (p == NGX_CSSMIN_AGAIN)
+            {
+                return p;
+            }
+            if (p == '{')
+            {
+                c = 0;
+            }
         }
         break;
     case STATE_ATRULE:
@@ -164,11 +204,11 @@ static int machine(int c, ngx_buf_t *in)
         if (c == '\n' || c == ';')
         {
             c = ';';
-            state = STATE_FREE;
+            ctx->state = STATE_FREE;
         }
         else if (c == '{')
         {
-            state = STATE_BLOCK;
+            ctx->state = STATE_BLOCK;
         }
         break;
     case STATE_BLOCK:
@@ -179,27 +219,35 @@ static int machine(int c, ngx_buf_t *in)
         }
         else if (c == '}')
         {
-            state = STATE_FREE;
+            ctx->state = STATE_FREE;
             break;
         }
         else
         {
-            state = STATE_DECLARATION;
+            ctx->state = STATE_DECLARATION;
         }
+
+        /* fall through */
+
     case STATE_DECLARATION:
         //support in paren because data can uris have ;
         if (c == '(')
         {
-            in_paren = 1;
+            ctx->in_paren = 1;
         }
-        if (in_paren == 0)
+        if (ctx->in_paren == 0)
         {
 
             if (c == ';')
             {
-                state = STATE_BLOCK;
+                ctx->state = STATE_BLOCK;
                 //could continue peeking through white space..
-                if (peek(in) == '}')
+                p = peek(ctx, in);
+                if (p == NGX_CSSMIN_AGAIN)
+                {
+                    return p;
+                }
+                if (p == '}')
                 {
                     c = 0;
                 }
@@ -207,7 +255,7 @@ static int machine(int c, ngx_buf_t *in)
             else if (c == '}')
             {
                 //handle unterminated declaration
-                state = STATE_FREE;
+                ctx->state = STATE_FREE;
             }
             else if (c == '\n')
             {
@@ -217,7 +265,12 @@ static int machine(int c, ngx_buf_t *in)
             else if (c == ' ')
             {
                 //skip multiple spaces after each other
-                if (peek(in) == c)
+                p = peek(ctx, in);
+                if (p == NGX_CSSMIN_AGAIN)
+                {
+                    return p;
+                }
+                if (p == c)
                 {
                     c = 0;
                 }
@@ -225,15 +278,23 @@ static int machine(int c, ngx_buf_t *in)
         }
         else if (c == ')')
         {
-            in_paren = 0;
+            ctx->in_paren = 0;
         }
 
         break;
     case STATE_COMMENT:
-        if (c == '*' && peek(in) == '/')
+        if (c == '*')
         {
-            theLookahead = EOF;
-            state = tmp_state;
+            p = peek(ctx, in);
+            if (p == NGX_CSSMIN_AGAIN)
+            {
+                return p;
+            }
+            if (p == '/')
+            {
+                ctx->theLookahead = EOF;
+                ctx->state = ctx->tmp_state;
+            }
         }
         c = 0;
         break;
@@ -242,31 +303,109 @@ static int machine(int c, ngx_buf_t *in)
     return c;
 }
 
+/* cssmin_create -- allocate the per-request parser state, starting in
+ * STATE_FREE so nothing leaks from one response into the next.
+ */
+
+ngx_cssmin_ctx_t *cssmin_create(ngx_pool_t *pool)
+{
+    ngx_cssmin_ctx_t *ctx;
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_cssmin_ctx_t));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     ctx->in_paren = 0;
+     *     ctx->ncarry = 0;
+     *     ctx->last = 0;
+     */
+
+    ctx->theLookahead = EOF;
+    ctx->pending = EOF;
+    ctx->state = STATE_FREE;
+    ctx->tmp_state = STATE_FREE;
+
+    return ctx;
+}
+
+/* cssmin_resumable -- true when ctx, having run out of input, behaves
+ * exactly like a fresh one: between rules (STATE_SELECTOR treats every
+ * character as STATE_FREE does), outside parens, with nothing pending.
+ * A stylesheet can then be cut there and the pieces minified separately.
+ */
+
+ngx_uint_t cssmin_resumable(ngx_cssmin_ctx_t *ctx)
+{
+    return (ctx->state == STATE_FREE || ctx->state == STATE_SELECTOR) && ctx->in_paren == 0 && ctx->theLookahead == EOF && ctx->pending == EOF && ctx->ncarry == 0;
+}
+
 /* cssmin -- minify the css
  * removes comments
  * removes newlines and line feeds keeping
  * removes last semicolon from last property
+ *
+ * Output is appended at out->last. Returns NGX_AGAIN when the input buffer
+ * is exhausted, NGX_BUSY when the output buffer is full and NGX_OK once the
+ * last input buffer (ctx->last) has been minified completely.
+ *
+ * Every character written has been read before, so with ctx->in_place set
+ * the output can share the input buffer, trailing in->pos.
  */
 
-void cssmin(ngx_buf_t *in, ngx_buf_t *out)
+ngx_int_t cssmin(ngx_cssmin_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out)
 {
+    int c;
+
+    ctx->in = in;
+
+    if (ctx->ncarry && out->last < ngx_out_end(ctx, out))
+    {
+        out->last[0] = ctx->carry[0];
+        ++out->last;
+        ctx->ncarry = 0;
+    }
+
     for (;;)
     {
-        int c = get(in);
+        if (ctx->ncarry)
+        {
+            return NGX_BUSY;
+        }
 
+        c = ctx->pending;
         if (c == EOF)
         {
-            out->end = out->pos;
-            out->last = out->pos;
-            out->pos = out->start;
-            break;
+            c = get(ctx, in);
+        }
+
+        if (c == NGX_CSSMIN_AGAIN)
+        {
+            return NGX_AGAIN;
+        }
+
+        if (c == EOF)
+        {
+            return NGX_OK;
+        }
+
+        ctx->pending = c;
+        c = machine(ctx, c, in);
+
+        if (c == NGX_CSSMIN_AGAIN)
+        {
+            return NGX_AGAIN;
         }
 
-        c = machine(c, in);
+        ctx->pending = EOF;
 
         if (c != 0)
         {
-            ngx_putc(c, out);
+            ngx_putc(ctx, c, out);
         }
     }
 }
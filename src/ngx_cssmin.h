@@ -1,3 +1,31 @@
-void cssmin(ngx_buf_t *in,ngx_buf_t *out);
+/* returned by the input reader when the current buffer is exhausted */
+#define NGX_CSSMIN_AGAIN -2
+
+typedef struct
+{
+    int theLookahead;
+    int state;
+    int tmp_state;
+    int in_paren;
+
+    /* character machine() was working on when the input ran out */
+    int pending;
+
+    /* machine() emits at most one character per step */
+    u_char carry[1];
+    size_t ncarry;
+
+    /* input buffer of the current call, bounds the output when in place */
+    ngx_buf_t *in;
+
+    unsigned last : 1;
+    unsigned in_place : 1;
+} ngx_cssmin_ctx_t;
+
+ngx_cssmin_ctx_t *cssmin_create(ngx_pool_t *pool);
+
+ngx_uint_t cssmin_resumable(ngx_cssmin_ctx_t *ctx);
+
+ngx_int_t cssmin(ngx_cssmin_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out);
 
 
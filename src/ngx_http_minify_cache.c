@@ -0,0 +1,2001 @@
+
+/*
+ * Copyright (C) skysbird
+ */
+
+/*
+ * 压缩结果的共享内存缓存。每个条目和数据一起从 slab 里分配，挂在红黑树上
+ * 按 key 查找，同时挂在 LRU 队列上；空间不够时从队尾淘汰。
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_minify_cache.h"
+
+#if (NGX_LINUX)
+#include <sys/inotify.h>
+#endif
+
+/* how many entries a store may evict before it gives up */
+#define NGX_HTTP_MINIFY_CACHE_EVICT 16
+
+typedef struct
+{
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *node;
+} ngx_http_minify_cache_cleanup_t;
+
+typedef struct
+{
+    ngx_http_minify_cache_t *cache;
+    u_char key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    ngx_msec_t expire;
+} ngx_http_minify_cache_unlock_t;
+
+#if (NGX_LINUX)
+
+typedef struct
+{
+    int wd;
+    ngx_str_t path;
+} ngx_http_minify_cache_dir_t;
+
+typedef struct
+{
+    ngx_http_minify_cache_t *cache;
+    ngx_array_t dirs;
+    int fd;
+    /* a directory could not be watched, changes in it would be missed */
+    unsigned failed : 1;
+} ngx_http_minify_cache_watcher_t;
+
+#define NGX_HTTP_MINIFY_CACHE_WATCH_MASK                                    \
+    (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE        \
+     | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+#endif
+
+static void ngx_http_minify_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                                      ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_minify_cache_name_insert_value(ngx_rbtree_node_t *temp,
+                                                    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_minify_cache_node_t *ngx_http_minify_cache_find(ngx_rbtree_t *rbtree,
+                                                                u_char *key);
+static ngx_http_minify_cache_node_t *ngx_http_minify_cache_find_name(ngx_rbtree_t *rbtree,
+                                                                     u_char *name);
+static void ngx_http_minify_cache_evict(ngx_http_minify_cache_t *cache,
+                                        ngx_http_minify_cache_node_t *mcn);
+static void ngx_http_minify_worker_cache_evict(ngx_http_minify_cache_node_t *mcn);
+static void ngx_http_minify_cache_cleanup(void *data);
+static void ngx_http_minify_cache_unlock(void *data);
+#if (NGX_LINUX)
+static void ngx_http_minify_cache_bump(ngx_http_minify_cache_sh_t *sh, uint32_t path_hash);
+static void ngx_http_minify_cache_bump_all(ngx_http_minify_cache_sh_t *sh);
+static ngx_int_t ngx_http_minify_cache_watch_tree(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path,
+                                                  ngx_log_t *log);
+static ngx_int_t ngx_http_minify_cache_watch_parents(ngx_http_minify_cache_watcher_t *w, ngx_log_t *log);
+static ngx_int_t ngx_http_minify_cache_watch_dir(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static ngx_int_t ngx_http_minify_cache_watch_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static ngx_int_t ngx_http_minify_cache_watch_spec(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static void ngx_http_minify_cache_watch_drop(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path);
+static void ngx_http_minify_cache_watch_handler(ngx_event_t *rev);
+static void ngx_http_minify_cache_watch_fail(ngx_http_minify_cache_watcher_t *w, ngx_log_t *log);
+static ngx_uint_t ngx_http_minify_cache_watch_is_root(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path);
+static ngx_uint_t ngx_http_minify_cache_watch_in_root(ngx_http_minify_cache_watcher_t *w,
+                                                      ngx_str_t *path);
+static ngx_uint_t ngx_http_minify_cache_watch_above_root(ngx_http_minify_cache_watcher_t *w,
+                                                         ngx_str_t *path);
+#endif
+static void ngx_http_minify_cache_record(ngx_http_minify_cache_sh_t *sh, u_char *key);
+static ngx_uint_t ngx_http_minify_cache_frequency(ngx_http_minify_cache_sh_t *sh, u_char *key);
+static void ngx_http_minify_worker_cache_cleanup(void *data);
+
+/* created by the first store in each worker */
+static ngx_http_minify_worker_cache_t *ngx_http_minify_worker_cache;
+
+/*
+ * cache 结构在解析 minify_cache_zone 时从配置 pool 里分配，放在 shm_zone->data；
+ * reload 时沿用旧共享内存里的树和队列。
+ */
+ngx_int_t
+ngx_http_minify_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_minify_cache_t *ocache = data;
+
+    size_t len;
+    ngx_uint_t width;
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache)
+    {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists)
+    {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_minify_cache_sh_t));
+    if (cache->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_minify_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    ngx_rbtree_init(&cache->sh->locks, &cache->sh->locks_sentinel,
+                    ngx_http_minify_cache_rbtree_insert_value);
+
+    ngx_rbtree_init(&cache->sh->names, &cache->sh->names_sentinel,
+                    ngx_http_minify_cache_name_insert_value);
+
+    /* about one counter per kilobyte of zone in each row */
+
+    for (width = 1024; width < shm_zone->shm.size / 1024; width <<= 1)
+    {
+        /* void */
+    }
+
+    cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                        width * NGX_HTTP_MINIFY_CACHE_SKETCH_DEPTH);
+    if (cache->sh->sketch == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cache->sh->width = width;
+
+    len = sizeof(" in minify cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in minify cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * 命中时 value 直接指向共享内存里的数据，不拷贝；条目的计数加一，
+ * 在 pool 销毁（请求结束）时减掉，期间即使被淘汰也不会释放。
+ * 同时把条目移到 LRU 队首。不论命中与否都计入访问频率。
+ */
+ngx_int_t
+ngx_http_minify_cache_lookup(ngx_shm_zone_t *shm_zone, u_char *key,
+                             ngx_pool_t *pool, ngx_str_t *value)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *mcn;
+    ngx_http_minify_cache_cleanup_t *mcc;
+
+    cache = shm_zone->data;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_minify_cache_cleanup_t));
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_minify_cache_record(cache->sh, key);
+
+    mcn = ngx_http_minify_cache_find(&cache->sh->rbtree, key);
+
+    if (mcn == NULL)
+    {
+        cache->sh->stats.misses++;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    cache->sh->stats.hits++;
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &mcn->queue);
+
+    mcn->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    value->len = mcn->len;
+    value->data = mcn->data;
+
+    mcc = cln->data;
+    mcc->cache = cache;
+    mcc->node = mcn;
+
+    cln->handler = ngx_http_minify_cache_cleanup;
+
+    return NGX_OK;
+}
+
+/*
+ * minify_cache_use_stale：按名字（URI 或 minify_cache_key，不含文件版本）
+ * 找最近存入的条目，内容可能已经过时。不计入命中统计。
+ */
+ngx_int_t
+ngx_http_minify_cache_lookup_stale(ngx_shm_zone_t *shm_zone, u_char *name,
+                                   ngx_pool_t *pool, ngx_str_t *value)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *mcn;
+    ngx_http_minify_cache_cleanup_t *mcc;
+
+    cache = shm_zone->data;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_minify_cache_cleanup_t));
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mcn = ngx_http_minify_cache_find_name(&cache->sh->names, name);
+
+    if (mcn == NULL)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &mcn->queue);
+
+    mcn->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    value->len = mcn->len;
+    value->data = mcn->data;
+
+    mcc = cln->data;
+    mcc->cache = cache;
+    mcc->node = mcn;
+
+    cln->handler = ngx_http_minify_cache_cleanup;
+
+    return NGX_OK;
+}
+
+/*
+ * minify_cache_watch：按名字找最新的条目，文件路径的 generation 没变就说明
+ * 文件没有改过，不需要 stat。命中时把条目的 key 拷到 key 里。
+ */
+ngx_int_t
+ngx_http_minify_cache_lookup_watched(ngx_shm_zone_t *shm_zone, u_char *name,
+                                     uint32_t path_hash, ngx_pool_t *pool,
+                                     ngx_str_t *value, u_char *key)
+{
+    ngx_atomic_uint_t generation;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *mcn;
+    ngx_http_minify_cache_cleanup_t *mcc;
+
+    cache = shm_zone->data;
+
+    if (!cache->sh->watching)
+    {
+        return NGX_DECLINED;
+    }
+
+    generation = ngx_http_minify_cache_generation(shm_zone, path_hash);
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_minify_cache_cleanup_t));
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mcn = ngx_http_minify_cache_find_name(&cache->sh->names, name);
+
+    if (mcn == NULL || mcn->path_hash != path_hash || mcn->generation != generation)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_http_minify_cache_record(cache->sh, mcn->key);
+    cache->sh->stats.hits++;
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &mcn->queue);
+
+    mcn->count++;
+
+    ngx_memcpy(key, mcn->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    value->len = mcn->len;
+    value->data = mcn->data;
+
+    mcc = cln->data;
+    mcc->cache = cache;
+    mcc->node = mcn;
+
+    cln->handler = ngx_http_minify_cache_cleanup;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_minify_cache_cleanup(void *data)
+{
+    ngx_http_minify_cache_cleanup_t *mcc = data;
+
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *mcn;
+
+    cache = mcc->cache;
+    mcn = mcc->node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (--mcn->count == 0 && mcn->removed)
+    {
+        ngx_slab_free_locked(cache->shpool, mcn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+ * 准入（TinyLFU）：新条目的访问频率不到 min_uses 的不存；空间不够时从 LRU
+ * 队尾挑淘汰对象，只有它们都不比新条目更常用、并且最多 EVICT 个就能腾出
+ * 足够空间时才淘汰，所以一个很大的冷文件挤不掉一批小的热文件。
+ * 同名的旧版本在新条目存入后淘汰。
+ */
+ngx_int_t
+ngx_http_minify_cache_store(ngx_shm_zone_t *shm_zone, u_char *key,
+                            u_char *name, uint32_t path_hash,
+                            ngx_atomic_uint_t generation, u_char *data,
+                            size_t len, ngx_uint_t min_uses, ngx_log_t *log)
+{
+    size_t size, freed;
+    ngx_uint_t i, freq;
+    ngx_queue_t *q, *prev;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *mcn, *victim;
+
+    cache = shm_zone->data;
+    size = offsetof(ngx_http_minify_cache_node_t, data) + len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mcn = ngx_http_minify_cache_find(&cache->sh->rbtree, key);
+
+    if (mcn)
+    {
+        /* filled by another request in the meantime, or checked again by stat */
+
+        if (path_hash == mcn->path_hash)
+        {
+            mcn->generation = generation;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    freq = ngx_http_minify_cache_frequency(cache->sh, key);
+
+    if (freq < min_uses)
+    {
+        goto rejected;
+    }
+
+    mcn = ngx_slab_alloc_locked(cache->shpool, size);
+
+    if (mcn == NULL)
+    {
+        freed = 0;
+        q = ngx_queue_last(&cache->sh->queue);
+
+        for (i = 0; freed < size; i++)
+        {
+            if (i == NGX_HTTP_MINIFY_CACHE_EVICT || q == ngx_queue_sentinel(&cache->sh->queue))
+            {
+                goto rejected;
+            }
+
+            victim = ngx_queue_data(q, ngx_http_minify_cache_node_t, queue);
+
+            if (ngx_http_minify_cache_frequency(cache->sh, victim->key) > freq)
+            {
+                goto rejected;
+            }
+
+            freed += offsetof(ngx_http_minify_cache_node_t, data) + victim->len;
+            q = ngx_queue_prev(q);
+        }
+
+        for (q = ngx_queue_last(&cache->sh->queue); i; i--)
+        {
+            prev = ngx_queue_prev(q);
+            ngx_http_minify_cache_evict(cache, ngx_queue_data(q, ngx_http_minify_cache_node_t, queue));
+            q = prev;
+        }
+
+        mcn = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (mcn == NULL)
+        {
+            goto rejected;
+        }
+    }
+
+    victim = ngx_http_minify_cache_find_name(&cache->sh->names, name);
+
+    if (victim)
+    {
+        ngx_http_minify_cache_evict(cache, victim);
+    }
+
+    ngx_memcpy(&mcn->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(mcn->key, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    ngx_memcpy(&mcn->name_node.key, name, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(mcn->name, name, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    mcn->len = len;
+    mcn->path_hash = path_hash;
+    mcn->generation = generation;
+    mcn->count = 0;
+    mcn->removed = 0;
+    ngx_memcpy(mcn->data, data, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &mcn->node);
+    ngx_rbtree_insert(&cache->sh->names, &mcn->name_node);
+    ngx_queue_insert_head(&cache->sh->queue, &mcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+
+rejected:
+
+    cache->sh->stats.rejected++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "minify cache zone \"%V\" rejected %uz bytes used %ui times",
+                   &shm_zone->shm.name, len, freq);
+
+    return NGX_DECLINED;
+}
+
+/*
+ * minify_cache_lock：第一个未命中的请求拿到 key 的锁负责压缩，锁在它的 pool
+ * 销毁时释放；其他请求得到 NGX_BUSY，等锁释放后再查缓存。持锁的 worker
+ * 异常退出时锁不会释放，所以锁带有超时，过期后下一个请求接手。
+ */
+ngx_int_t
+ngx_http_minify_cache_lock(ngx_shm_zone_t *shm_zone, u_char *key,
+                           ngx_pool_t *pool, ngx_msec_t timeout)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *lock;
+    ngx_http_minify_cache_unlock_t *mcu;
+
+    cache = shm_zone->data;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_minify_cache_unlock_t));
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_minify_cache_find(&cache->sh->locks, key);
+
+    if (lock && (ngx_msec_int_t)(lock->expire - ngx_current_msec) > 0)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_BUSY;
+    }
+
+    if (lock == NULL)
+    {
+        lock = ngx_slab_alloc_locked(cache->shpool,
+                                     offsetof(ngx_http_minify_cache_node_t, data));
+        if (lock == NULL)
+        {
+            /* no room for the lock, minify without it */
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        ngx_memcpy(&lock->node.key, key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(lock->key, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        ngx_rbtree_insert(&cache->sh->locks, &lock->node);
+    }
+
+    lock->expire = ngx_current_msec + timeout;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    mcu = cln->data;
+    mcu->cache = cache;
+    mcu->expire = lock->expire;
+    ngx_memcpy(mcu->key, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    cln->handler = ngx_http_minify_cache_unlock;
+
+    return NGX_OK;
+}
+
+ngx_uint_t
+ngx_http_minify_cache_locked(ngx_shm_zone_t *shm_zone, u_char *key)
+{
+    ngx_uint_t locked;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *lock;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_minify_cache_find(&cache->sh->locks, key);
+    locked = (lock && (ngx_msec_int_t)(lock->expire - ngx_current_msec) > 0);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return locked;
+}
+
+/*
+ * minify_preload 用：只看 key 在不在，不计入统计和频率。
+ */
+ngx_uint_t
+ngx_http_minify_cache_exists(ngx_shm_zone_t *shm_zone, u_char *key)
+{
+    ngx_uint_t exists;
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    exists = (ngx_http_minify_cache_find(&cache->sh->rbtree, key) != NULL);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return exists;
+}
+
+static void
+ngx_http_minify_cache_unlock(void *data)
+{
+    ngx_http_minify_cache_unlock_t *mcu = data;
+
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_node_t *lock;
+
+    cache = mcu->cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lock = ngx_http_minify_cache_find(&cache->sh->locks, mcu->key);
+
+    /* unless it expired and was taken over */
+
+    if (lock && lock->expire == mcu->expire)
+    {
+        ngx_rbtree_delete(&cache->sh->locks, &lock->node);
+        ngx_slab_free_locked(cache->shpool, lock);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+ * minify_cache_content 的 body hash：每次取 8 字节，两路分别做乘法和移位
+ * 混合，结束时加入长度再各自做一次 fmix64，得到 16 字节。不是加密 hash，
+ * 所以两路的初值和结束时的混合都用 master 启动时取的随机 secret，外面
+ * 不知道 secret 就造不出碰撞，没法让别的 URL 命中自己的内容。
+ */
+#define ngx_http_minify_rotl64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* chosen once in the master, the workers inherit it and it outlives reloads */
+static uint64_t ngx_http_minify_cache_secret[2];
+
+static ngx_inline void
+ngx_http_minify_cache_hash_word(ngx_http_minify_cache_hash_t *h, uint64_t w)
+{
+    h->a = ngx_http_minify_rotl64((h->a ^ w) * 0x9e3779b97f4a7c15ULL, 31);
+    h->b = (h->b + w) * 0xc2b2ae3d27d4eb4fULL;
+    h->b ^= h->b >> 29;
+}
+
+static ngx_inline uint64_t
+ngx_http_minify_cache_fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+ngx_int_t
+ngx_http_minify_cache_hash_secret(ngx_log_t *log)
+{
+    ssize_t n;
+    ngx_fd_t fd;
+
+    if (ngx_http_minify_cache_secret[0] || ngx_http_minify_cache_secret[1])
+    {
+        return NGX_OK;
+    }
+
+    fd = ngx_open_file("/dev/urandom", NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      ngx_open_file_n " \"/dev/urandom\" failed");
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, ngx_http_minify_cache_secret, sizeof(ngx_http_minify_cache_secret));
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"/dev/urandom\" failed");
+    }
+
+    if (n != (ssize_t)sizeof(ngx_http_minify_cache_secret))
+    {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      ngx_read_fd_n " \"/dev/urandom\" failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+void
+ngx_http_minify_cache_hash_init(ngx_http_minify_cache_hash_t *h)
+{
+    h->a = 0x243f6a8885a308d3ULL ^ ngx_http_minify_cache_secret[0];
+    h->b = 0x13198a2e03707344ULL ^ ngx_http_minify_cache_secret[1];
+    h->len = 0;
+    h->ntail = 0;
+}
+
+void
+ngx_http_minify_cache_hash_update(ngx_http_minify_cache_hash_t *h, u_char *data, size_t len)
+{
+    size_t n;
+    uint64_t w;
+
+    h->len += len;
+
+    if (h->ntail)
+    {
+        n = ngx_min(len, 8 - h->ntail);
+        ngx_memcpy(h->tail + h->ntail, data, n);
+
+        h->ntail += n;
+        data += n;
+        len -= n;
+
+        if (h->ntail < 8)
+        {
+            return;
+        }
+
+        ngx_memcpy(&w, h->tail, 8);
+        ngx_http_minify_cache_hash_word(h, w);
+        h->ntail = 0;
+    }
+
+    for (/* void */; len >= 8; data += 8, len -= 8)
+    {
+        ngx_memcpy(&w, data, 8);
+        ngx_http_minify_cache_hash_word(h, w);
+    }
+
+    if (len)
+    {
+        ngx_memcpy(h->tail, data, len);
+        h->ntail = len;
+    }
+}
+
+void
+ngx_http_minify_cache_hash_final(u_char *key, ngx_http_minify_cache_hash_t *h)
+{
+    uint64_t w, a, b;
+
+    if (h->ntail)
+    {
+        ngx_memzero(h->tail + h->ntail, 8 - h->ntail);
+        ngx_memcpy(&w, h->tail, 8);
+        ngx_http_minify_cache_hash_word(h, w);
+    }
+
+    ngx_http_minify_cache_hash_word(h, h->len);
+    ngx_http_minify_cache_hash_word(h, ngx_http_minify_cache_secret[1]);
+
+    a = ngx_http_minify_cache_fmix64(h->a + h->b);
+    b = ngx_http_minify_cache_fmix64(h->b ^ ngx_http_minify_rotl64(h->a, 17)
+                                     ^ ngx_http_minify_cache_secret[0]);
+
+    ngx_memcpy(key, &a, 8);
+    ngx_memcpy(key + 8, &b, 8);
+}
+
+/*
+ * 路径的 hash，连续的 '/' 当作一个，这样 root 和 URI 拼出来的路径
+ * 和 inotify 报告的路径一致。
+ */
+uint32_t
+ngx_http_minify_cache_path_hash(u_char *path, size_t len)
+{
+    u_char *p, *last;
+    uint32_t crc;
+
+    ngx_crc32_init(crc);
+
+    last = path + len;
+
+    for (p = path; p < last; p++)
+    {
+        if (*p == '/' && p + 1 < last && p[1] == '/')
+        {
+            continue;
+        }
+
+        ngx_crc32_update(&crc, p, 1);
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+ngx_atomic_uint_t
+ngx_http_minify_cache_generation(ngx_shm_zone_t *shm_zone, uint32_t path_hash)
+{
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    return cache->sh->generation[path_hash % NGX_HTTP_MINIFY_CACHE_GENERATIONS];
+}
+
+#if (NGX_LINUX)
+
+static void
+ngx_http_minify_cache_bump(ngx_http_minify_cache_sh_t *sh, uint32_t path_hash)
+{
+    (void)ngx_atomic_fetch_add(&sh->generation[path_hash % NGX_HTTP_MINIFY_CACHE_GENERATIONS], 1);
+}
+
+static void
+ngx_http_minify_cache_bump_all(ngx_http_minify_cache_sh_t *sh)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < NGX_HTTP_MINIFY_CACHE_GENERATIONS; i++)
+    {
+        (void)ngx_atomic_fetch_add(&sh->generation[i], 1);
+    }
+}
+
+#endif
+
+/*
+ * 解析配置时记下开了 minify_cache_watch 的 location 的 root，按 zone 去重。
+ */
+ngx_int_t
+ngx_http_minify_cache_watch_root(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone, ngx_str_t *root)
+{
+    ngx_str_t *r;
+    ngx_uint_t i;
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    if (cache->roots == NULL)
+    {
+        cache->roots = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
+        if (cache->roots == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    r = cache->roots->elts;
+
+    for (i = 0; i < cache->roots->nelts; i++)
+    {
+        if (r[i].len == root->len && ngx_strncmp(r[i].data, root->data, root->len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
+    r = ngx_array_push(cache->roots);
+    if (r == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    *r = *root;
+
+    return NGX_OK;
+}
+
+#if (NGX_LINUX)
+
+/*
+ * 在一个 worker 里用 inotify 监视各个 root 及其所有子目录，文件有变化就
+ * 增加它的路径对应的 generation；目录的创建、删除和改名会牵连下面所有的
+ * 文件，全部 generation 都增加。root 的上一级也监视，用来发现部署时整个
+ * root 被换掉（比如换符号链接）。开始监视前的改动没有记录，所以先把全部
+ * generation 都增加一次。有目录监视不了（不存在、超过 max_user_watches）
+ * 或者树里有符号链接时整个 zone 都不监视，命中一律靠 stat 检查。
+ */
+ngx_int_t
+ngx_http_minify_cache_watch(ngx_cycle_t *cycle, ngx_shm_zone_t *shm_zone)
+{
+    int fd;
+    ngx_str_t *root, path;
+    ngx_uint_t i;
+    ngx_connection_t *c;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_cache_watcher_t *w;
+
+    cache = shm_zone->data;
+
+    /* until the watch is set up entries are only trusted after a stat */
+
+    cache->sh->watching = 0;
+
+    if (cache->roots == NULL)
+    {
+        return NGX_OK;
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "inotify_init1() failed for minify cache zone \"%V\"",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    w = ngx_pcalloc(cycle->pool, sizeof(ngx_http_minify_cache_watcher_t));
+    if (w == NULL)
+    {
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    w->cache = cache;
+    w->fd = fd;
+
+    if (ngx_array_init(&w->dirs, cycle->pool, 64, sizeof(ngx_http_minify_cache_dir_t)) != NGX_OK)
+    {
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    root = cache->roots->elts;
+
+    for (i = 0; i < cache->roots->nelts; i++)
+    {
+        path.len = root[i].len;
+        path.data = ngx_pnalloc(cycle->pool, path.len + 1);
+        if (path.data == NULL)
+        {
+            close(fd);
+            return NGX_ERROR;
+        }
+
+        ngx_cpystrn(path.data, root[i].data, path.len + 1);
+
+        (void)ngx_http_minify_cache_watch_tree(w, &path, cycle->log);
+    }
+
+    (void)ngx_http_minify_cache_watch_parents(w, cycle->log);
+
+    if (w->failed)
+    {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "minify cache zone \"%V\" not watched, "
+                      "cached output is checked by stat()",
+                      &shm_zone->shm.name);
+        close(fd);
+        return NGX_DECLINED;
+    }
+
+    c = ngx_get_connection(fd, cycle->log);
+    if (c == NULL)
+    {
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    c->data = w;
+    c->read->handler = ngx_http_minify_cache_watch_handler;
+    c->read->log = cycle->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    cache->watch = c;
+
+    ngx_http_minify_cache_bump_all(cache->sh);
+
+    cache->sh->watching = 1;
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "minify cache zone \"%V\" watching %ui directories",
+                  &shm_zone->shm.name, w->dirs.nelts);
+
+    return NGX_OK;
+}
+
+/*
+ * 监视 path 和它下面的所有目录，path 要以 0 结尾；失败时 w->failed 置位。
+ */
+static ngx_int_t
+ngx_http_minify_cache_watch_tree(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path,
+                                 ngx_log_t *log)
+{
+    ngx_tree_ctx_t tree;
+
+    ngx_memzero(&tree, sizeof(ngx_tree_ctx_t));
+
+    tree.file_handler = ngx_http_minify_cache_watch_noop;
+    tree.pre_tree_handler = ngx_http_minify_cache_watch_dir;
+    tree.post_tree_handler = ngx_http_minify_cache_watch_noop;
+    tree.spec_handler = ngx_http_minify_cache_watch_spec;
+    tree.data = w;
+    tree.log = log;
+
+    if (ngx_http_minify_cache_watch_dir(&tree, path) == NGX_OK
+        && ngx_walk_tree(&tree, path) != NGX_OK)
+    {
+        w->failed = 1;
+    }
+
+    return w->failed ? NGX_ERROR : NGX_OK;
+}
+
+/*
+ * root 的上一级只关心 root 这个名字，但和树里的目录一样用完整的 mask：
+ * 同一个目录的监视只有一个，后加的 mask 会替换前面的。
+ */
+static ngx_int_t
+ngx_http_minify_cache_watch_parents(ngx_http_minify_cache_watcher_t *w, ngx_log_t *log)
+{
+    u_char *p;
+    ngx_str_t *root, path;
+    ngx_uint_t i;
+    ngx_tree_ctx_t tree;
+
+    ngx_memzero(&tree, sizeof(ngx_tree_ctx_t));
+
+    tree.data = w;
+    tree.log = log;
+
+    root = w->cache->roots->elts;
+
+    for (i = 0; i < w->cache->roots->nelts; i++)
+    {
+        if (root[i].len == 1)
+        {
+            continue;
+        }
+
+        for (p = root[i].data + root[i].len - 1; p > root[i].data && *p != '/'; p--)
+        {
+            /* void */
+        }
+
+        path.len = (p == root[i].data) ? 1 : (size_t)(p - root[i].data);
+
+        path.data = ngx_alloc(path.len + 1, log);
+        if (path.data == NULL)
+        {
+            w->failed = 1;
+            break;
+        }
+
+        ngx_cpystrn(path.data, root[i].data, path.len + 1);
+
+        (void)ngx_http_minify_cache_watch_dir(&tree, &path);
+
+        ngx_free(path.data);
+    }
+
+    return w->failed ? NGX_ERROR : NGX_OK;
+}
+
+/*
+ * 槽位按 wd 找：同一个目录再加一次得到同一个 wd（比如在树里改了名），
+ * 就更新它的路径；否则用 wd 为 -1 的空槽，所以目录来来去去时不会增长。
+ */
+static ngx_int_t
+ngx_http_minify_cache_watch_dir(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_minify_cache_watcher_t *w = ctx->data;
+
+    int wd;
+    u_char *data;
+    ngx_uint_t i;
+    ngx_http_minify_cache_dir_t *dir, *slot;
+
+    wd = inotify_add_watch(w->fd, (char *)path->data, NGX_HTTP_MINIFY_CACHE_WATCH_MASK | IN_ONLYDIR);
+
+    if (wd == -1)
+    {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, ngx_errno,
+                      "inotify_add_watch(\"%s\") failed", path->data);
+
+        /* ENOSPC: out of watches, nothing more will be added */
+
+        w->failed = 1;
+
+        return NGX_DECLINED;
+    }
+
+    data = ngx_alloc(path->len + 1, ctx->log);
+    if (data == NULL)
+    {
+        w->failed = 1;
+        return NGX_ABORT;
+    }
+
+    ngx_cpystrn(data, path->data, path->len + 1);
+
+    dir = w->dirs.elts;
+    slot = NULL;
+
+    for (i = 0; i < w->dirs.nelts; i++)
+    {
+        if (dir[i].wd == wd)
+        {
+            break;
+        }
+
+        if (dir[i].wd == -1 && slot == NULL)
+        {
+            slot = &dir[i];
+        }
+    }
+
+    if (i < w->dirs.nelts)
+    {
+        dir = &dir[i];
+        ngx_free(dir->path.data);
+    }
+    else if (slot)
+    {
+        dir = slot;
+    }
+    else
+    {
+        dir = ngx_array_push(&w->dirs);
+        if (dir == NULL)
+        {
+            ngx_free(data);
+            w->failed = 1;
+            return NGX_ABORT;
+        }
+    }
+
+    dir->wd = wd;
+    dir->path.len = path->len;
+    dir->path.data = data;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_cache_watch_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+/*
+ * 树里的符号链接：指向的文件或目录改了，事件报在链接外面的路径上，这里
+ * 看不到，所以整个 zone 不监视。
+ */
+static ngx_int_t
+ngx_http_minify_cache_watch_spec(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_minify_cache_watcher_t *w = ctx->data;
+
+    ngx_file_info_t fi;
+
+    if (ngx_link_info(path->data, &fi) != NGX_FILE_ERROR && ngx_is_link(&fi))
+    {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "minify cache watch does not follow the symbolic link \"%V\"",
+                      path);
+
+        w->failed = 1;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * 去掉 path 和它下面所有目录的监视：目录搬走了，旧的路径不能再用。
+ */
+static void
+ngx_http_minify_cache_watch_drop(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path)
+{
+    ngx_uint_t i;
+    ngx_http_minify_cache_dir_t *dir;
+
+    dir = w->dirs.elts;
+
+    for (i = 0; i < w->dirs.nelts; i++)
+    {
+        if (dir[i].wd == -1 || dir[i].path.len < path->len
+            || ngx_strncmp(dir[i].path.data, path->data, path->len) != 0
+            || (dir[i].path.len > path->len && dir[i].path.data[path->len] != '/'))
+        {
+            continue;
+        }
+
+        /* the IN_IGNORED that follows finds no slot */
+
+        (void)inotify_rm_watch(w->fd, dir[i].wd);
+
+        dir[i].wd = -1;
+        ngx_free(dir[i].path.data);
+        dir[i].path.data = NULL;
+        dir[i].path.len = 0;
+    }
+}
+
+static void
+ngx_http_minify_cache_watch_handler(ngx_event_t *rev)
+{
+    ssize_t n;
+    u_char *p, *file;
+    size_t len;
+    uint32_t hash;
+    ngx_str_t path;
+    ngx_uint_t i, root;
+    ngx_connection_t *c;
+    ngx_file_info_t fi;
+    ngx_http_minify_cache_dir_t *dir;
+    struct inotify_event *ev;
+    ngx_http_minify_cache_watcher_t *w;
+    u_char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    c = rev->data;
+    w = c->data;
+
+    for (;;)
+    {
+        n = read(c->fd, buf, sizeof(buf));
+
+        if (n == -1)
+        {
+            if (ngx_errno != NGX_EAGAIN)
+            {
+                ngx_log_error(NGX_LOG_ALERT, rev->log, ngx_errno,
+                              "inotify read() failed");
+            }
+
+            break;
+        }
+
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event *)p;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                /* events were lost, new directories among them perhaps */
+
+                ngx_http_minify_cache_watch_fail(w, rev->log);
+                continue;
+            }
+
+            dir = w->dirs.elts;
+
+            for (i = 0; i < w->dirs.nelts; i++)
+            {
+                if (dir[i].wd == ev->wd)
+                {
+                    break;
+                }
+            }
+
+            if (i == w->dirs.nelts)
+            {
+                continue;
+            }
+
+            dir = &dir[i];
+
+            if (ev->mask & (IN_IGNORED | IN_MOVE_SELF))
+            {
+                /*
+                 * a directory above a root went away, and with it the
+                 * parent watch that would see the root come back
+                 */
+
+                if (ngx_http_minify_cache_watch_above_root(w, &dir->path))
+                {
+                    ngx_http_minify_cache_watch_fail(w, rev->log);
+                }
+
+                if (ev->mask & IN_IGNORED)
+                {
+                    /* one below a root is watched again when it is created */
+
+                    dir->wd = -1;
+                    ngx_free(dir->path.data);
+                    dir->path.data = NULL;
+                    dir->path.len = 0;
+
+                    ngx_http_minify_cache_bump_all(w->cache->sh);
+                }
+
+                continue;
+            }
+
+            if (ev->len == 0)
+            {
+                continue;
+            }
+
+            len = dir->path.len + 1 + ngx_strlen(ev->name);
+
+            file = ngx_alloc(len + 1, rev->log);
+            if (file == NULL)
+            {
+                ngx_http_minify_cache_watch_fail(w, rev->log);
+                continue;
+            }
+
+            if (dir->path.len == 1)
+            {
+                /* the parent of a root in "/" */
+                len--;
+                ngx_sprintf(file, "/%s%Z", ev->name);
+            }
+            else
+            {
+                ngx_sprintf(file, "%V/%s%Z", &dir->path, ev->name);
+            }
+
+            path.len = len;
+            path.data = file;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                           "minify cache watch: \"%s\" changed, mask:%xd",
+                           file, ev->mask);
+
+            root = ngx_http_minify_cache_watch_is_root(w, &path);
+
+            if (!root && !ngx_http_minify_cache_watch_in_root(w, &dir->path))
+            {
+                /* the parent of a root, watched for the root alone */
+
+                ngx_free(file);
+                continue;
+            }
+
+            if (!(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+                || !(root || (ev->mask & IN_ISDIR)))
+            {
+                hash = ngx_http_minify_cache_path_hash(file, len);
+                ngx_http_minify_cache_bump(w->cache->sh, hash);
+
+                if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    && ngx_link_info(file, &fi) != NGX_FILE_ERROR && ngx_is_link(&fi))
+                {
+                    ngx_log_error(NGX_LOG_WARN, rev->log, 0,
+                                  "minify cache watch does not follow the "
+                                  "symbolic link \"%s\"", file);
+
+                    ngx_http_minify_cache_watch_fail(w, rev->log);
+                }
+
+                ngx_free(file);
+                continue;
+            }
+
+            /*
+             * a directory, or a root swapped by a deploy, was created,
+             * removed or renamed with everything below it: the old watches
+             * have the old paths, and any file may have changed
+             */
+
+            if (ngx_http_minify_cache_watch_above_root(w, &path))
+            {
+                ngx_http_minify_cache_watch_fail(w, rev->log);
+                ngx_free(file);
+                continue;
+            }
+
+            ngx_http_minify_cache_watch_drop(w, &path);
+
+            if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+                && (ngx_http_minify_cache_watch_tree(w, &path, rev->log) != NGX_OK
+                    || (root && ngx_http_minify_cache_watch_parents(w, rev->log) != NGX_OK)))
+            {
+                ngx_http_minify_cache_watch_fail(w, rev->log);
+            }
+
+            ngx_http_minify_cache_bump_all(w->cache->sh);
+
+            ngx_free(file);
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK)
+    {
+        ngx_http_minify_cache_watch_fail(w, rev->log);
+
+        w->cache->watch = NULL;
+        ngx_close_connection(c);
+    }
+}
+
+/*
+ * 有目录监视不了，之后的改动可能漏掉：不再信任 generation，命中都靠 stat。
+ */
+static void
+ngx_http_minify_cache_watch_fail(ngx_http_minify_cache_watcher_t *w, ngx_log_t *log)
+{
+    if (!w->cache->sh->watching)
+    {
+        return;
+    }
+
+    w->cache->sh->watching = 0;
+
+    ngx_http_minify_cache_bump_all(w->cache->sh);
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "minify cache watch given up, cached output is checked by stat()");
+}
+
+static ngx_uint_t
+ngx_http_minify_cache_watch_is_root(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path)
+{
+    ngx_str_t *root;
+    ngx_uint_t i;
+
+    root = w->cache->roots->elts;
+
+    for (i = 0; i < w->cache->roots->nelts; i++)
+    {
+        if (root[i].len == path->len && ngx_strncmp(root[i].data, path->data, path->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* path is a root or below one */
+
+static ngx_uint_t
+ngx_http_minify_cache_watch_in_root(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path)
+{
+    ngx_str_t *root;
+    ngx_uint_t i;
+
+    root = w->cache->roots->elts;
+
+    for (i = 0; i < w->cache->roots->nelts; i++)
+    {
+        if (path->len >= root[i].len && ngx_strncmp(path->data, root[i].data, root[i].len) == 0
+            && (path->len == root[i].len || path->data[root[i].len] == '/'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* path is a directory some root is below */
+
+static ngx_uint_t
+ngx_http_minify_cache_watch_above_root(ngx_http_minify_cache_watcher_t *w, ngx_str_t *path)
+{
+    ngx_str_t *root;
+    ngx_uint_t i;
+
+    root = w->cache->roots->elts;
+
+    for (i = 0; i < w->cache->roots->nelts; i++)
+    {
+        if (path->len == 1 && path->data[0] == '/' && root[i].len > 1)
+        {
+            return 1;
+        }
+
+        if (root[i].len > path->len && root[i].data[path->len] == '/'
+            && ngx_strncmp(root[i].data, path->data, path->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+ngx_int_t
+ngx_http_minify_cache_watch(ngx_cycle_t *cycle, ngx_shm_zone_t *shm_zone)
+{
+    return NGX_OK;
+}
+
+#endif
+
+/*
+ * worker 退出时关掉 inotify 描述符，否则 nginx 会报告连接没有关闭。
+ */
+void
+ngx_http_minify_cache_unwatch(ngx_shm_zone_t *shm_zone)
+{
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    if (cache->watch == NULL)
+    {
+        return;
+    }
+
+    /*
+     * sh->watching is left alone: after a reload the zone is watched by
+     * the new worker 0 already
+     */
+
+    ngx_close_connection(cache->watch);
+    cache->watch = NULL;
+}
+
+void
+ngx_http_minify_cache_stats(ngx_shm_zone_t *shm_zone, ngx_http_minify_cache_stats_t *stats)
+{
+    ngx_http_minify_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    *stats = cache->sh->stats;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+ * count-min sketch：key 本身是 md5，每行用其中一个 32 位字做下标，
+ * 计数饱和于 255，采样满 10 倍宽度后全部减半，让过去的热度逐渐失效。
+ */
+static void
+ngx_http_minify_cache_record(ngx_http_minify_cache_sh_t *sh, u_char *key)
+{
+    uint32_t hash;
+    ngx_uint_t i;
+    u_char *counter;
+
+    for (i = 0; i < NGX_HTTP_MINIFY_CACHE_SKETCH_DEPTH; i++)
+    {
+        ngx_memcpy(&hash, key + i * sizeof(uint32_t), sizeof(uint32_t));
+        counter = &sh->sketch[i * sh->width + (hash & (sh->width - 1))];
+
+        if (*counter < 255)
+        {
+            (*counter)++;
+        }
+    }
+
+    if (++sh->samples < sh->width * 10)
+    {
+        return;
+    }
+
+    for (i = 0; i < sh->width * NGX_HTTP_MINIFY_CACHE_SKETCH_DEPTH; i++)
+    {
+        sh->sketch[i] >>= 1;
+    }
+
+    sh->samples /= 2;
+}
+
+static ngx_uint_t
+ngx_http_minify_cache_frequency(ngx_http_minify_cache_sh_t *sh, u_char *key)
+{
+    uint32_t hash;
+    ngx_uint_t i, freq, n;
+
+    freq = 255;
+
+    for (i = 0; i < NGX_HTTP_MINIFY_CACHE_SKETCH_DEPTH; i++)
+    {
+        ngx_memcpy(&hash, key + i * sizeof(uint32_t), sizeof(uint32_t));
+        n = sh->sketch[i * sh->width + (hash & (sh->width - 1))];
+
+        if (n < freq)
+        {
+            freq = n;
+        }
+    }
+
+    return freq;
+}
+
+/*
+ * 进程内缓存：结构和共享内存里的一样，但只有本进程访问，不用加锁，
+ * 条目用 ngx_alloc 分配，总大小超过 max_size 时从 LRU 队尾淘汰。
+ * 命中同样不拷贝，由 pool cleanup 释放引用。
+ */
+ngx_int_t
+ngx_http_minify_worker_cache_lookup(u_char *key, ngx_pool_t *pool, ngx_str_t *value)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_worker_cache_t *wc;
+    ngx_http_minify_cache_node_t *mcn;
+
+    wc = ngx_http_minify_worker_cache;
+
+    if (wc == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    mcn = ngx_http_minify_cache_find(&wc->rbtree, key);
+
+    if (mcn == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_minify_worker_cache_cleanup;
+    cln->data = mcn;
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_queue_insert_head(&wc->queue, &mcn->queue);
+
+    mcn->count++;
+
+    value->len = mcn->len;
+    value->data = mcn->data;
+
+    return NGX_OK;
+}
+
+/*
+ * minify_cache_watch 的命中先查进程内缓存：按名字找，路径、zone 和 generation
+ * 都对得上就不用去碰共享内存的锁。
+ */
+ngx_int_t
+ngx_http_minify_worker_cache_lookup_watched(ngx_shm_zone_t *shm_zone, u_char *name,
+                                            uint32_t path_hash, ngx_pool_t *pool,
+                                            ngx_str_t *value, u_char *key)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_cache_t *cache;
+    ngx_http_minify_worker_cache_t *wc;
+    ngx_http_minify_cache_node_t *mcn;
+
+    wc = ngx_http_minify_worker_cache;
+    cache = shm_zone->data;
+
+    if (wc == NULL || !cache->sh->watching)
+    {
+        return NGX_DECLINED;
+    }
+
+    mcn = ngx_http_minify_cache_find_name(&wc->names, name);
+
+    if (mcn == NULL || mcn->zone != shm_zone || mcn->path_hash != path_hash
+        || mcn->generation != ngx_http_minify_cache_generation(shm_zone, path_hash))
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_minify_worker_cache_cleanup;
+    cln->data = mcn;
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_queue_insert_head(&wc->queue, &mcn->queue);
+
+    mcn->count++;
+
+    ngx_memcpy(key, mcn->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    value->len = mcn->len;
+    value->data = mcn->data;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_minify_worker_cache_cleanup(void *data)
+{
+    ngx_http_minify_cache_node_t *mcn = data;
+
+    if (--mcn->count == 0 && mcn->removed)
+    {
+        ngx_free(mcn);
+    }
+}
+
+void
+ngx_http_minify_worker_cache_store(size_t max_size, u_char *key, u_char *name,
+                                   ngx_shm_zone_t *shm_zone, uint32_t path_hash,
+                                   ngx_atomic_uint_t generation, u_char *data,
+                                   size_t len, ngx_log_t *log)
+{
+    size_t size;
+    ngx_queue_t *q;
+    ngx_http_minify_worker_cache_t *wc;
+    ngx_http_minify_cache_node_t *mcn;
+
+    size = offsetof(ngx_http_minify_cache_node_t, data) + len;
+
+    if (size > max_size)
+    {
+        return;
+    }
+
+    wc = ngx_http_minify_worker_cache;
+
+    if (wc == NULL)
+    {
+        wc = ngx_alloc(sizeof(ngx_http_minify_worker_cache_t), log);
+        if (wc == NULL)
+        {
+            return;
+        }
+
+        ngx_rbtree_init(&wc->rbtree, &wc->sentinel,
+                        ngx_http_minify_cache_rbtree_insert_value);
+        ngx_rbtree_init(&wc->names, &wc->names_sentinel,
+                        ngx_http_minify_cache_name_insert_value);
+        ngx_queue_init(&wc->queue);
+
+        wc->size = 0;
+        wc->max_size = max_size;
+
+        ngx_http_minify_worker_cache = wc;
+    }
+
+    mcn = ngx_http_minify_cache_find(&wc->rbtree, key);
+
+    if (mcn)
+    {
+        /* checked again by stat, or found in the zone by name */
+
+        if (shm_zone && (mcn->zone == NULL || path_hash == mcn->path_hash))
+        {
+            mcn->zone = shm_zone;
+            mcn->path_hash = path_hash;
+            mcn->generation = generation;
+        }
+
+        return;
+    }
+
+    mcn = ngx_http_minify_cache_find_name(&wc->names, name);
+
+    if (mcn)
+    {
+        /* an older version of the same file or URI */
+        ngx_http_minify_worker_cache_evict(mcn);
+    }
+
+    while (wc->size + size > wc->max_size && !ngx_queue_empty(&wc->queue))
+    {
+        q = ngx_queue_last(&wc->queue);
+        ngx_http_minify_worker_cache_evict(ngx_queue_data(q, ngx_http_minify_cache_node_t, queue));
+    }
+
+    if (wc->size + size > wc->max_size)
+    {
+        return;
+    }
+
+    mcn = ngx_alloc(size, log);
+    if (mcn == NULL)
+    {
+        return;
+    }
+
+    ngx_memcpy(&mcn->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(mcn->key, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    ngx_memcpy(&mcn->name_node.key, name, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(mcn->name, name, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    mcn->len = len;
+    mcn->path_hash = path_hash;
+    mcn->generation = generation;
+    mcn->zone = shm_zone;
+    mcn->count = 0;
+    mcn->removed = 0;
+    ngx_memcpy(mcn->data, data, len);
+
+    ngx_rbtree_insert(&wc->rbtree, &mcn->node);
+    ngx_rbtree_insert(&wc->names, &mcn->name_node);
+    ngx_queue_insert_head(&wc->queue, &mcn->queue);
+
+    wc->size += size;
+}
+
+static void
+ngx_http_minify_worker_cache_evict(ngx_http_minify_cache_node_t *mcn)
+{
+    ngx_http_minify_worker_cache_t *wc;
+
+    wc = ngx_http_minify_worker_cache;
+
+    ngx_queue_remove(&mcn->queue);
+    ngx_rbtree_delete(&wc->rbtree, &mcn->node);
+    ngx_rbtree_delete(&wc->names, &mcn->name_node);
+
+    wc->size -= offsetof(ngx_http_minify_cache_node_t, data) + mcn->len;
+
+    if (mcn->count)
+    {
+        /* freed by the last request still sending it */
+        mcn->removed = 1;
+        return;
+    }
+
+    ngx_free(mcn);
+}
+
+static ngx_http_minify_cache_node_t *
+ngx_http_minify_cache_find(ngx_rbtree_t *rbtree, u_char *key)
+{
+    ngx_int_t rc;
+    ngx_rbtree_key_t node_key;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_minify_cache_node_t *mcn;
+
+    ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel)
+    {
+        if (node_key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        mcn = (ngx_http_minify_cache_node_t *)node;
+
+        rc = ngx_memcmp(key, mcn->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        if (rc == 0)
+        {
+            return mcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static ngx_http_minify_cache_node_t *
+ngx_http_minify_cache_find_name(ngx_rbtree_t *rbtree, u_char *name)
+{
+    ngx_int_t rc;
+    ngx_rbtree_key_t node_key;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_minify_cache_node_t *mcn;
+
+    ngx_memcpy(&node_key, name, sizeof(ngx_rbtree_key_t));
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel)
+    {
+        if (node_key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        mcn = ngx_rbtree_data(node, ngx_http_minify_cache_node_t, name_node);
+
+        rc = ngx_memcmp(name, mcn->name, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        if (rc == 0)
+        {
+            return mcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_minify_cache_evict(ngx_http_minify_cache_t *cache,
+                            ngx_http_minify_cache_node_t *mcn)
+{
+    ngx_queue_remove(&mcn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &mcn->node);
+    ngx_rbtree_delete(&cache->sh->names, &mcn->name_node);
+
+    if (mcn->count)
+    {
+        mcn->removed = 1;
+        return;
+    }
+
+    ngx_slab_free_locked(cache->shpool, mcn);
+}
+
+static void
+ngx_http_minify_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                          ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_minify_cache_node_t *mcn, *mcnt;
+
+    for (;;)
+    {
+        if (node->key < temp->key)
+        {
+            p = &temp->left;
+        }
+        else if (node->key > temp->key)
+        {
+            p = &temp->right;
+        }
+        else
+        {
+            /* node->key == temp->key */
+
+            mcn = (ngx_http_minify_cache_node_t *)node;
+            mcnt = (ngx_http_minify_cache_node_t *)temp;
+
+            p = (ngx_memcmp(mcn->key, mcnt->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel)
+        {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static void
+ngx_http_minify_cache_name_insert_value(ngx_rbtree_node_t *temp,
+                                        ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_minify_cache_node_t *mcn, *mcnt;
+
+    for (;;)
+    {
+        if (node->key < temp->key)
+        {
+            p = &temp->left;
+        }
+        else if (node->key > temp->key)
+        {
+            p = &temp->right;
+        }
+        else
+        {
+            /* node->key == temp->key */
+
+            mcn = ngx_rbtree_data(node, ngx_http_minify_cache_node_t, name_node);
+            mcnt = ngx_rbtree_data(temp, ngx_http_minify_cache_node_t, name_node);
+
+            p = (ngx_memcmp(mcn->name, mcnt->name, NGX_HTTP_MINIFY_CACHE_KEY_LEN) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel)
+        {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
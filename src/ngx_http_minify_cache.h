@@ -0,0 +1,162 @@
+
+/*
+ * Copyright (C) skysbird
+ */
+
+#ifndef _NGX_HTTP_MINIFY_CACHE_H_INCLUDED_
+#define _NGX_HTTP_MINIFY_CACHE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* entries are keyed by the md5 of the source identity */
+#define NGX_HTTP_MINIFY_CACHE_KEY_LEN 16
+
+/* generation counters for minify_cache_watch, by path hash */
+#define NGX_HTTP_MINIFY_CACHE_GENERATIONS 1024
+
+/* rows of the count-min sketch, one 32-bit word of the key each */
+#define NGX_HTTP_MINIFY_CACHE_SKETCH_DEPTH 4
+
+typedef struct
+{
+    ngx_uint_t hits;
+    ngx_uint_t misses;
+    ngx_uint_t rejected;
+} ngx_http_minify_cache_stats_t;
+
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    /* keys being minified by some request, see minify_cache_lock */
+    ngx_rbtree_t locks;
+    ngx_rbtree_node_t locks_sentinel;
+    /* the latest entry for each URI or minify_cache_key, by name */
+    ngx_rbtree_t names;
+    ngx_rbtree_node_t names_sentinel;
+    ngx_http_minify_cache_stats_t stats;
+    /* lookups per key, halved every 10 * width lookups */
+    u_char *sketch;
+    ngx_uint_t width;
+    ngx_uint_t samples;
+    /* bumped by the watcher when a file hashing to the slot changes */
+    ngx_atomic_t generation[NGX_HTTP_MINIFY_CACHE_GENERATIONS];
+    ngx_atomic_t watching;
+} ngx_http_minify_cache_sh_t;
+
+typedef struct
+{
+    ngx_http_minify_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    /* document roots to watch, ngx_str_t */
+    ngx_array_t *roots;
+    /* the inotify descriptor, in the worker that watches */
+    ngx_connection_t *watch;
+} ngx_http_minify_cache_t;
+
+typedef struct
+{
+    ngx_rbtree_node_t node;
+    ngx_rbtree_node_t name_node;
+    ngx_queue_t queue;
+    u_char key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    u_char name[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    size_t len;
+    /* minify_cache_watch: the file's path hash and its generation when checked */
+    uint32_t path_hash;
+    ngx_atomic_uint_t generation;
+    /* worker cache only: the zone whose generations these are */
+    ngx_shm_zone_t *zone;
+    /* requests still sending data, a removed entry is freed by the last */
+    ngx_uint_t count;
+    /* lock entries only: when the lock is given up on */
+    ngx_msec_t expire;
+    unsigned removed : 1;
+    u_char data[1];
+} ngx_http_minify_cache_node_t;
+
+/* incremental body hash for minify_cache_content, two 64-bit lanes */
+typedef struct
+{
+    uint64_t a;
+    uint64_t b;
+    uint64_t len;
+    u_char tail[8];
+    size_t ntail;
+} ngx_http_minify_cache_hash_t;
+
+/* the per-worker cache in front of the zone, no locking */
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    /* the latest entry for each name, as in the zone */
+    ngx_rbtree_t names;
+    ngx_rbtree_node_t names_sentinel;
+    ngx_queue_t queue;
+    size_t size;
+    size_t max_size;
+} ngx_http_minify_worker_cache_t;
+
+ngx_int_t ngx_http_minify_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+ngx_int_t ngx_http_minify_cache_lookup(ngx_shm_zone_t *shm_zone, u_char *key,
+                                       ngx_pool_t *pool, ngx_str_t *value);
+
+ngx_int_t ngx_http_minify_cache_lookup_stale(ngx_shm_zone_t *shm_zone, u_char *name,
+                                             ngx_pool_t *pool, ngx_str_t *value);
+
+ngx_int_t ngx_http_minify_cache_lookup_watched(ngx_shm_zone_t *shm_zone, u_char *name,
+                                               uint32_t path_hash, ngx_pool_t *pool,
+                                               ngx_str_t *value, u_char *key);
+
+ngx_int_t ngx_http_minify_cache_store(ngx_shm_zone_t *shm_zone, u_char *key,
+                                      u_char *name, uint32_t path_hash,
+                                      ngx_atomic_uint_t generation, u_char *data,
+                                      size_t len, ngx_uint_t min_uses, ngx_log_t *log);
+
+ngx_int_t ngx_http_minify_cache_lock(ngx_shm_zone_t *shm_zone, u_char *key,
+                                     ngx_pool_t *pool, ngx_msec_t timeout);
+
+ngx_uint_t ngx_http_minify_cache_locked(ngx_shm_zone_t *shm_zone, u_char *key);
+
+ngx_uint_t ngx_http_minify_cache_exists(ngx_shm_zone_t *shm_zone, u_char *key);
+
+ngx_int_t ngx_http_minify_cache_hash_secret(ngx_log_t *log);
+void ngx_http_minify_cache_hash_init(ngx_http_minify_cache_hash_t *h);
+void ngx_http_minify_cache_hash_update(ngx_http_minify_cache_hash_t *h, u_char *data,
+                                       size_t len);
+void ngx_http_minify_cache_hash_final(u_char *key, ngx_http_minify_cache_hash_t *h);
+
+uint32_t ngx_http_minify_cache_path_hash(u_char *path, size_t len);
+
+ngx_atomic_uint_t ngx_http_minify_cache_generation(ngx_shm_zone_t *shm_zone,
+                                                   uint32_t path_hash);
+
+ngx_int_t ngx_http_minify_cache_watch_root(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone,
+                                           ngx_str_t *root);
+
+ngx_int_t ngx_http_minify_cache_watch(ngx_cycle_t *cycle, ngx_shm_zone_t *shm_zone);
+
+void ngx_http_minify_cache_unwatch(ngx_shm_zone_t *shm_zone);
+
+void ngx_http_minify_cache_stats(ngx_shm_zone_t *shm_zone,
+                                 ngx_http_minify_cache_stats_t *stats);
+
+ngx_int_t ngx_http_minify_worker_cache_lookup(u_char *key, ngx_pool_t *pool,
+                                              ngx_str_t *value);
+
+ngx_int_t ngx_http_minify_worker_cache_lookup_watched(ngx_shm_zone_t *shm_zone,
+                                                      u_char *name, uint32_t path_hash,
+                                                      ngx_pool_t *pool, ngx_str_t *value,
+                                                      u_char *key);
+
+void ngx_http_minify_worker_cache_store(size_t max_size, u_char *key, u_char *name,
+                                        ngx_shm_zone_t *shm_zone, uint32_t path_hash,
+                                        ngx_atomic_uint_t generation, u_char *data,
+                                        size_t len, ngx_log_t *log);
+
+#endif /* _NGX_HTTP_MINIFY_CACHE_H_INCLUDED_ */
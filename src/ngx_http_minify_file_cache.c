@@ -0,0 +1,1213 @@
+
+/*
+ * Copyright (C) skysbird
+ */
+
+/*
+ * 压缩结果的文件缓存（minify_cache_path）。文件名是 key 的十六进制，按 levels
+ * 分目录；共享内存里只放索引：红黑树加 LRU 队列，记录大小和最后访问时间，
+ * 用来执行 max_size 和 inactive。命中时以 in_file 缓冲发送，可以走 sendfile。
+ * 重启后索引是空的而文件还在：索引里没有时直接尝试打开文件，打开了就补进索引；
+ * 0 号 worker 启动时分批遍历 path，把以前的文件都补进索引，之后定时执行
+ * inactive 和 max_size，所以没有新文件写入时旧文件也会删除。
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_minify_file_cache.h"
+
+/* how many files a store may remove before it gives up */
+#define NGX_HTTP_MINIFY_FILE_CACHE_EVICT 16
+
+/* loader batches, as minify_preload's */
+#define NGX_HTTP_MINIFY_FILE_CACHE_LOAD_FILES 100
+#define NGX_HTTP_MINIFY_FILE_CACHE_LOAD_THRESHOLD 20
+
+/* the manager's pause while there is work left, and between checks */
+#define NGX_HTTP_MINIFY_FILE_CACHE_SLEEP 50
+#define NGX_HTTP_MINIFY_FILE_CACHE_MANAGE 10000
+
+typedef struct
+{
+    ngx_dir_t dir;
+    ngx_str_t path;
+} ngx_http_minify_file_cache_dir_t;
+
+/*
+ * 0 号 worker 里每个 minify_cache_path 的管理状态：加载时正在读的目录组成
+ * 一个栈，加载完 pool 就销毁了。
+ */
+typedef struct
+{
+    ngx_event_t event;
+    ngx_http_minify_file_cache_t *cache;
+    ngx_pool_t *pool;
+    ngx_array_t dirs;
+    /* path of the current directory entry, reused */
+    u_char *name;
+    size_t name_size;
+    /* the name the current file would have */
+    u_char *expect;
+    ngx_msec_t start;
+    ngx_uint_t files;
+    off_t size;
+} ngx_http_minify_file_cache_manager_t;
+
+static ngx_int_t ngx_http_minify_file_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_minify_file_cache_load_init(ngx_http_minify_file_cache_manager_t *m);
+static void ngx_http_minify_file_cache_manager_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_minify_file_cache_load_next(ngx_http_minify_file_cache_manager_t *m);
+static ngx_int_t ngx_http_minify_file_cache_load_file(ngx_http_minify_file_cache_manager_t *m,
+                                                      ngx_str_t *path, ngx_dir_t *dir);
+static ngx_uint_t ngx_http_minify_file_cache_evict(ngx_http_minify_file_cache_t *cache, off_t len,
+                                                   ngx_pool_t *pool, ngx_log_t *log);
+static ngx_int_t ngx_http_minify_file_cache_name(ngx_pool_t *pool, ngx_path_t *path,
+                                                 u_char *key, ngx_str_t *name);
+static void ngx_http_minify_file_cache_add(ngx_http_minify_file_cache_t *cache,
+                                           u_char *key, off_t size);
+static ngx_http_minify_file_cache_node_t *ngx_http_minify_file_cache_find(ngx_http_minify_file_cache_t *cache,
+                                                                          u_char *key);
+static void ngx_http_minify_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                                           ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+/* zones of minify_cache_path are told apart from minify_cache_zone by this tag */
+static ngx_uint_t ngx_http_minify_file_cache_tag;
+
+/*
+ * minify_cache_path path [levels=1:2] keys_zone=name:size [max_size=size]
+ *     [inactive=time];
+ */
+char *
+ngx_http_minify_file_cache_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char *p, *last;
+    ssize_t size;
+    ngx_str_t s, name, *value;
+    ngx_uint_t i, n;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_minify_file_cache_t *cache;
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_minify_file_cache_t));
+    if (cache == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (cache->path == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->max_size = NGX_MAX_OFF_T_VALUE;
+    cache->inactive = 600;
+
+    value = cf->args->elts;
+
+    cache->path->name = value[1];
+
+    if (cache->path->name.data[cache->path->name.len - 1] == '/')
+    {
+        cache->path->name.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &cache->path->name, 0) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = 0;
+    size = 0;
+
+    for (i = 2; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "levels=", 7) == 0)
+        {
+            p = value[i].data + 7;
+            last = value[i].data + value[i].len;
+
+            for (n = 0; n < NGX_MAX_PATH_LEVEL && p < last; n++)
+            {
+                if (*p > '0' && *p < '3')
+                {
+                    cache->path->level[n] = *p++ - '0';
+                    cache->path->len += cache->path->level[n] + 1;
+
+                    if (p == last)
+                    {
+                        break;
+                    }
+
+                    if (*p++ == ':' && n < NGX_MAX_PATH_LEVEL - 1 && p < last)
+                    {
+                        continue;
+                    }
+
+                    goto invalid_levels;
+                }
+
+                goto invalid_levels;
+            }
+
+            if (cache->path->len < 10 + NGX_MAX_PATH_LEVEL)
+            {
+                continue;
+            }
+
+        invalid_levels:
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid \"levels\" \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0)
+        {
+            name.data = value[i].data + 10;
+
+            p = (u_char *)ngx_strchr(name.data, ':');
+
+            if (p == NULL)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t)(2 * ngx_pagesize))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "keys zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0)
+        {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            cache->max_size = ngx_parse_offset(&s);
+
+            if (cache->max_size < 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"max_size\" value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0)
+        {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            cache->inactive = ngx_parse_time(&s, 1);
+
+            if (cache->inactive == (time_t)NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"inactive\" value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0 || size == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"keys_zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    cache->path->conf_file = cf->conf_file->file.name.data;
+    cache->path->line = cf->conf_file->line;
+
+    if (ngx_add_path(cf, &cache->path) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_minify_file_cache_tag);
+    if (shm_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_minify_file_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+ngx_shm_zone_t *
+ngx_http_minify_file_cache_zone(ngx_conf_t *cf, ngx_str_t *name)
+{
+    return ngx_shared_memory_add(cf, name, 0, &ngx_http_minify_file_cache_tag);
+}
+
+static ngx_int_t
+ngx_http_minify_file_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_minify_file_cache_t *ocache = data;
+
+    size_t len;
+    ngx_http_minify_file_cache_t *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache)
+    {
+        if (ngx_strcmp(cache->path->name.data, ocache->path->name.data) != 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "minify cache \"%V\" uses the \"%V\" cache path "
+                          "while previously it used the \"%V\" cache path",
+                          &shm_zone->shm.name, &cache->path->name,
+                          &ocache->path->name);
+            return NGX_ERROR;
+        }
+
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists)
+    {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_minify_file_cache_sh_t));
+    if (cache->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_minify_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    cache->sh->cold = 1;
+
+    len = sizeof(" in minify cache keys zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in minify cache keys zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * 0 号 worker 调用：给每个 minify_cache_path 起一个定时器，先分批加载以前
+ * 留下的文件（共享内存是新建的时候），然后定时执行 inactive 和 max_size。
+ */
+ngx_int_t
+ngx_http_minify_file_cache_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_minify_file_cache_manager_t *m;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */; i++)
+    {
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_minify_file_cache_tag)
+        {
+            continue;
+        }
+
+        m = ngx_pcalloc(cycle->pool, sizeof(ngx_http_minify_file_cache_manager_t));
+        if (m == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        m->cache = shm_zone[i].data;
+
+        m->event.handler = ngx_http_minify_file_cache_manager_handler;
+        m->event.data = m;
+        m->event.log = cycle->log;
+        m->event.cancelable = 1;
+
+        /* a reload keeps the zone, and what is in it */
+
+        if (m->cache->sh->cold && ngx_http_minify_file_cache_load_init(m) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_add_timer(&m->event, NGX_HTTP_MINIFY_FILE_CACHE_SLEEP);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_file_cache_load_init(ngx_http_minify_file_cache_manager_t *m)
+{
+    ngx_path_t *path;
+    ngx_http_minify_file_cache_dir_t *d;
+
+    path = m->cache->path;
+
+    m->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, m->event.log);
+    if (m->pool == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&m->dirs, m->pool, NGX_MAX_PATH_LEVEL + 1,
+                       sizeof(ngx_http_minify_file_cache_dir_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    m->expect = ngx_pnalloc(m->pool, path->name.len + 1 + path->len
+                                         + 2 * NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+    if (m->expect == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    d = ngx_array_push(&m->dirs);
+    if (d == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* with the terminating zero, for ngx_open_dir() */
+
+    d->path.len = path->name.len;
+    d->path.data = ngx_pnalloc(m->pool, path->name.len + 1);
+    if (d->path.data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(d->path.data, path->name.data, path->name.len);
+    d->path.data[d->path.len] = '\0';
+
+    if (ngx_open_dir(&d->path, &d->dir) == NGX_ERROR)
+    {
+        if (ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, m->event.log, ngx_errno,
+                          ngx_open_dir_n " \"%V\" failed", &d->path);
+        }
+
+        m->dirs.nelts--;
+    }
+
+    m->start = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+/*
+ * 加载时每批最多 NGX_HTTP_MINIFY_FILE_CACHE_LOAD_FILES 个文件或者
+ * NGX_HTTP_MINIFY_FILE_CACHE_LOAD_THRESHOLD 毫秒；每次都从 LRU 队尾删一批，
+ * 删满了或者还在加载就 NGX_HTTP_MINIFY_FILE_CACHE_SLEEP 毫秒后再来。
+ */
+static void
+ngx_http_minify_file_cache_manager_handler(ngx_event_t *ev)
+{
+    ngx_int_t rc;
+    ngx_uint_t n;
+    ngx_msec_t start, timer;
+    ngx_pool_t *pool;
+    ngx_http_minify_file_cache_manager_t *m;
+
+    m = ev->data;
+
+    if (ngx_exiting)
+    {
+        if (m->pool)
+        {
+            ngx_destroy_pool(m->pool);
+            m->pool = NULL;
+        }
+
+        return;
+    }
+
+    timer = NGX_HTTP_MINIFY_FILE_CACHE_MANAGE;
+
+    if (m->pool)
+    {
+        ngx_time_update();
+        start = ngx_current_msec;
+        rc = NGX_AGAIN;
+
+        for (n = 0; n < NGX_HTTP_MINIFY_FILE_CACHE_LOAD_FILES; /* void */)
+        {
+            rc = ngx_http_minify_file_cache_load_next(m);
+
+            if (rc == NGX_DONE)
+            {
+                break;
+            }
+
+            if (rc == NGX_OK)
+            {
+                n++;
+            }
+
+            ngx_time_update();
+
+            if (ngx_current_msec - start >= NGX_HTTP_MINIFY_FILE_CACHE_LOAD_THRESHOLD)
+            {
+                break;
+            }
+        }
+
+        if (rc == NGX_DONE)
+        {
+            m->cache->sh->cold = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                          "minify cache \"%V\" loaded %ui files, %O bytes, in %M ms",
+                          &m->cache->path->name, m->files, m->size,
+                          ngx_current_msec - m->start);
+
+            ngx_destroy_pool(m->pool);
+            m->pool = NULL;
+        }
+        else
+        {
+            timer = NGX_HTTP_MINIFY_FILE_CACHE_SLEEP;
+        }
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log);
+
+    if (pool)
+    {
+        n = ngx_http_minify_file_cache_evict(m->cache, 0, pool, ev->log);
+
+        if (n == NGX_HTTP_MINIFY_FILE_CACHE_EVICT)
+        {
+            timer = NGX_HTTP_MINIFY_FILE_CACHE_SLEEP;
+        }
+
+        ngx_destroy_pool(pool);
+    }
+
+    ngx_add_timer(ev, timer);
+}
+
+/*
+ * 走一步：读一个目录项，进入子目录或者加载一个文件；加载了文件时返回
+ * NGX_OK，全部完成时返回 NGX_DONE。
+ */
+static ngx_int_t
+ngx_http_minify_file_cache_load_next(ngx_http_minify_file_cache_manager_t *m)
+{
+    u_char *p;
+    size_t len;
+    ngx_err_t err;
+    ngx_str_t name, path;
+    ngx_log_t *log;
+    ngx_http_minify_file_cache_dir_t *d;
+
+    log = m->event.log;
+
+    if (m->dirs.nelts == 0)
+    {
+        return NGX_DONE;
+    }
+
+    d = (ngx_http_minify_file_cache_dir_t *)m->dirs.elts + m->dirs.nelts - 1;
+
+    ngx_set_errno(0);
+
+    if (ngx_read_dir(&d->dir) == NGX_ERROR)
+    {
+        err = ngx_errno;
+
+        if (err != NGX_ENOMOREFILES)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_read_dir_n " \"%V\" failed", &d->path);
+        }
+
+        if (ngx_close_dir(&d->dir) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_close_dir_n " \"%V\" failed", &d->path);
+        }
+
+        m->dirs.nelts--;
+
+        return NGX_AGAIN;
+    }
+
+    len = ngx_de_namelen(&d->dir);
+    name.data = ngx_de_name(&d->dir);
+
+    if (name.data[0] == '.')
+    {
+        return NGX_AGAIN;
+    }
+
+    path.len = d->path.len + 1 + len;
+
+    if (path.len + 1 > m->name_size)
+    {
+        m->name_size = ngx_max(2 * m->name_size, path.len + 1);
+
+        m->name = ngx_pnalloc(m->pool, m->name_size);
+        if (m->name == NULL)
+        {
+            return NGX_DONE;
+        }
+    }
+
+    path.data = m->name;
+
+    p = ngx_cpymem(path.data, d->path.data, d->path.len);
+    *p++ = '/';
+    ngx_memcpy(p, name.data, len + 1);
+
+    if (!d->dir.valid_info && ngx_de_info(path.data, &d->dir) == NGX_FILE_ERROR)
+    {
+        if (ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_de_info_n " \"%V\" failed", &path);
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (ngx_de_is_dir(&d->dir))
+    {
+        if (m->dirs.nelts > NGX_MAX_PATH_LEVEL)
+        {
+            return NGX_AGAIN;
+        }
+
+        d = ngx_array_push(&m->dirs);
+        if (d == NULL)
+        {
+            return NGX_DONE;
+        }
+
+        d->path.len = path.len;
+        d->path.data = ngx_pnalloc(m->pool, path.len + 1);
+        if (d->path.data == NULL)
+        {
+            return NGX_DONE;
+        }
+
+        ngx_memcpy(d->path.data, path.data, path.len + 1);
+
+        if (ngx_open_dir(&d->path, &d->dir) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_dir_n " \"%V\" failed", &d->path);
+            m->dirs.nelts--;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (!ngx_de_is_file(&d->dir))
+    {
+        return NGX_AGAIN;
+    }
+
+    return ngx_http_minify_file_cache_load_file(m, &path, &d->dir);
+}
+
+/*
+ * 文件名是 key 的十六进制、目录和 levels 相符的记入索引；不相符的，比如
+ * levels 改过，永远不会命中，删掉。别的名字是 ngx_create_temp_file() 的
+ * 临时文件，可能正在写，超过 inactive 时间才删。
+ */
+static ngx_int_t
+ngx_http_minify_file_cache_load_file(ngx_http_minify_file_cache_manager_t *m,
+                                     ngx_str_t *path, ngx_dir_t *dir)
+{
+    u_char *p, *name;
+    size_t len;
+    ngx_int_t n;
+    ngx_uint_t i;
+    ngx_path_t *cpath;
+    u_char key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+
+    cpath = m->cache->path;
+
+    len = ngx_de_namelen(dir);
+    name = ngx_de_name(dir);
+
+    n = 0;
+
+    if (len == 2 * NGX_HTTP_MINIFY_CACHE_KEY_LEN)
+    {
+        for (i = 0; i < NGX_HTTP_MINIFY_CACHE_KEY_LEN; i++)
+        {
+            n = ngx_hextoi(name + 2 * i, 2);
+
+            if (n == NGX_ERROR)
+            {
+                break;
+            }
+
+            key[i] = (u_char)n;
+        }
+    }
+    else
+    {
+        n = NGX_ERROR;
+    }
+
+    if (n == NGX_ERROR)
+    {
+        if (ngx_time() - ngx_de_mtime(dir) < m->cache->inactive)
+        {
+            return NGX_AGAIN;
+        }
+    }
+    else
+    {
+        /* as ngx_http_minify_file_cache_name() */
+
+        len = cpath->name.len + 1 + cpath->len + 2 * NGX_HTTP_MINIFY_CACHE_KEY_LEN;
+
+        p = ngx_cpymem(m->expect, cpath->name.data, cpath->name.len);
+        p += 1 + cpath->len;
+        ngx_hex_dump(p, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        ngx_create_hashed_filename(cpath, m->expect, len);
+
+        if (path->len == len && ngx_memcmp(path->data, m->expect, len) == 0)
+        {
+            ngx_http_minify_file_cache_add(m->cache, key, ngx_de_size(dir));
+
+            m->files++;
+            m->size += ngx_de_size(dir);
+
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, m->event.log, 0,
+                  "minify cache removes stray file \"%V\"", path);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT)
+    {
+        ngx_log_error(NGX_LOG_CRIT, m->event.log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed", path);
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * 打开 key 对应的文件，返回指向它的 in_file 缓冲；文件描述符经过
+ * open_file_cache，没有配置时在请求结束时关闭。
+ */
+ngx_int_t
+ngx_http_minify_file_cache_open(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+                                u_char *key, ngx_buf_t **bp)
+{
+    ngx_buf_t *b;
+    ngx_str_t name;
+    ngx_uint_t indexed;
+    ngx_open_file_info_t of;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_minify_file_cache_t *cache;
+    ngx_http_minify_file_cache_node_t *fcn;
+
+    cache = shm_zone->data;
+
+    if (ngx_http_minify_file_cache_name(r->pool, cache->path, key, &name) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_minify_file_cache_find(cache, key);
+
+    if (fcn)
+    {
+        fcn->accessed = ngx_time();
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    }
+
+    indexed = (fcn != NULL);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &name, &of, r->pool) != NGX_OK)
+    {
+        if (of.err != NGX_ENOENT && of.err != NGX_ENOTDIR && of.err != 0)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
+                          "%s \"%V\" failed", of.failed, &name);
+        }
+
+        if (indexed)
+        {
+            /* removed behind our back */
+
+            ngx_shmtx_lock(&cache->shpool->mutex);
+
+            fcn = ngx_http_minify_file_cache_find(cache, key);
+
+            if (fcn)
+            {
+                cache->sh->size -= fcn->size;
+
+                ngx_queue_remove(&fcn->queue);
+                ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+                ngx_slab_free_locked(cache->shpool, fcn);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (!of.is_file)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!indexed)
+    {
+        /* written before a restart */
+
+        ngx_http_minify_file_cache_add(cache, key, of.size);
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    b->file->fd = of.fd;
+    b->file->name = name;
+    b->file->log = r->connection->log;
+    b->file->directio = of.is_directio;
+
+    b->file_pos = 0;
+    b->file_last = of.size;
+    b->in_file = of.size ? 1 : 0;
+
+    *bp = b;
+
+    return NGX_OK;
+}
+
+/*
+ * 写临时文件再改名成 key 对应的文件名，然后记入索引；超过 max_size 或者
+ * inactive 时间内没有访问的从 LRU 队尾删除，文件在解锁后才删。
+ */
+ngx_int_t
+ngx_http_minify_file_cache_store(ngx_shm_zone_t *shm_zone, u_char *key, u_char *data,
+                                 size_t len, ngx_pool_t *pool, ngx_log_t *log)
+{
+    ssize_t n;
+    ngx_str_t name;
+    ngx_file_t file;
+    ngx_ext_rename_file_t ext;
+    ngx_http_minify_file_cache_t *cache;
+    ngx_http_minify_file_cache_node_t *fcn;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    fcn = ngx_http_minify_file_cache_find(cache, key);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (fcn)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_minify_file_cache_name(pool, cache->path, key, &name) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = NGX_INVALID_FILE;
+    file.log = log;
+
+    if (ngx_create_temp_file(&file, cache->path, pool, 1, 0, NGX_FILE_OWNER_ACCESS) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    n = ngx_write_file(&file, data, len, 0);
+
+    if (n != (ssize_t)len)
+    {
+        if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return NGX_ERROR;
+    }
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = log;
+    ext.fd = file.fd;
+
+    if (ngx_ext_rename_file(&file.name, &name, &ext) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    (void)ngx_http_minify_file_cache_evict(cache, (off_t)len, pool, log);
+
+    ngx_http_minify_file_cache_add(cache, key, len);
+
+    return NGX_OK;
+}
+
+/*
+ * 从 LRU 队尾删除，直到留出 len 字节且队尾在 inactive 时间内访问过；一次
+ * 最多删 NGX_HTTP_MINIFY_FILE_CACHE_EVICT 个，文件在解锁后才删。返回删掉
+ * 的个数。
+ */
+static ngx_uint_t
+ngx_http_minify_file_cache_evict(ngx_http_minify_file_cache_t *cache, off_t len,
+                                 ngx_pool_t *pool, ngx_log_t *log)
+{
+    time_t now;
+    ngx_str_t name;
+    ngx_uint_t i, nvictims;
+    ngx_queue_t *q;
+    ngx_http_minify_file_cache_node_t *fcn;
+    u_char victims[NGX_HTTP_MINIFY_FILE_CACHE_EVICT][NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+
+    now = ngx_time();
+    nvictims = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    while (nvictims < NGX_HTTP_MINIFY_FILE_CACHE_EVICT && !ngx_queue_empty(&cache->sh->queue))
+    {
+        q = ngx_queue_last(&cache->sh->queue);
+        fcn = ngx_queue_data(q, ngx_http_minify_file_cache_node_t, queue);
+
+        if (cache->sh->size + len <= cache->max_size && now - fcn->accessed < cache->inactive)
+        {
+            break;
+        }
+
+        ngx_memcpy(victims[nvictims++], fcn->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        cache->sh->size -= fcn->size;
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    for (i = 0; i < nvictims; i++)
+    {
+        if (ngx_http_minify_file_cache_name(pool, cache->path, victims[i], &name) != NGX_OK)
+        {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "minify cache remove \"%V\"", &name);
+
+        if (ngx_delete_file(name.data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name.data);
+        }
+    }
+
+    return nvictims;
+}
+
+/*
+ * minify_preload 用：索引里没有时看文件在不在，在就补进索引。
+ */
+ngx_int_t
+ngx_http_minify_file_cache_exists(ngx_shm_zone_t *shm_zone, u_char *key,
+                                  ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_str_t name;
+    ngx_file_info_t fi;
+    ngx_http_minify_file_cache_t *cache;
+    ngx_http_minify_file_cache_node_t *fcn;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    fcn = ngx_http_minify_file_cache_find(cache, key);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (fcn)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_minify_file_cache_name(pool, cache->path, key, &name) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_file_info(name.data, &fi) == NGX_FILE_ERROR)
+    {
+        if (ngx_errno != NGX_ENOENT && ngx_errno != NGX_ENOTDIR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_file_info_n " \"%V\" failed", &name);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    ngx_http_minify_file_cache_add(cache, key, ngx_file_size(&fi));
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_file_cache_name(ngx_pool_t *pool, ngx_path_t *path, u_char *key,
+                                ngx_str_t *name)
+{
+    u_char *p;
+
+    name->len = path->name.len + 1 + path->len + 2 * NGX_HTTP_MINIFY_CACHE_KEY_LEN;
+
+    name->data = ngx_pnalloc(pool, name->len + 1);
+    if (name->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(name->data, path->name.data, path->name.len);
+    p += 1 + path->len;
+    p = ngx_hex_dump(p, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, name->data, name->len);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_minify_file_cache_add(ngx_http_minify_file_cache_t *cache, u_char *key, off_t size)
+{
+    ngx_http_minify_file_cache_node_t *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_minify_file_cache_find(cache, key))
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    /* without room in the index the file is still found by opening it */
+
+    fcn = ngx_slab_alloc_locked(cache->shpool, sizeof(ngx_http_minify_file_cache_node_t));
+
+    if (fcn)
+    {
+        ngx_memcpy(&fcn->node.key, key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(fcn->key, key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        fcn->size = size;
+        fcn->accessed = ngx_time();
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+
+        cache->sh->size += size;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static ngx_http_minify_file_cache_node_t *
+ngx_http_minify_file_cache_find(ngx_http_minify_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t rc;
+    ngx_rbtree_key_t node_key;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_minify_file_cache_node_t *fcn;
+
+    ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel)
+    {
+        if (node_key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_minify_file_cache_node_t *)node;
+
+        rc = ngx_memcmp(key, fcn->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+        if (rc == 0)
+        {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_minify_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                               ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_minify_file_cache_node_t *fcn, *fcnt;
+
+    for (;;)
+    {
+        if (node->key < temp->key)
+        {
+            p = &temp->left;
+        }
+        else if (node->key > temp->key)
+        {
+            p = &temp->right;
+        }
+        else
+        {
+            /* node->key == temp->key */
+
+            fcn = (ngx_http_minify_file_cache_node_t *)node;
+            fcnt = (ngx_http_minify_file_cache_node_t *)temp;
+
+            p = (ngx_memcmp(fcn->key, fcnt->key, NGX_HTTP_MINIFY_CACHE_KEY_LEN) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel)
+        {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
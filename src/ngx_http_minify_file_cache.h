@@ -0,0 +1,58 @@
+
+/*
+ * Copyright (C) skysbird
+ */
+
+#ifndef _NGX_HTTP_MINIFY_FILE_CACHE_H_INCLUDED_
+#define _NGX_HTTP_MINIFY_FILE_CACHE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_minify_cache.h"
+
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    off_t size;
+    /* files left by earlier runs are not indexed yet */
+    ngx_uint_t cold;
+} ngx_http_minify_file_cache_sh_t;
+
+typedef struct
+{
+    ngx_http_minify_file_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_path_t *path;
+    off_t max_size;
+    time_t inactive;
+} ngx_http_minify_file_cache_t;
+
+typedef struct
+{
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    u_char key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    off_t size;
+    time_t accessed;
+} ngx_http_minify_file_cache_node_t;
+
+char *ngx_http_minify_file_cache_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_shm_zone_t *ngx_http_minify_file_cache_zone(ngx_conf_t *cf, ngx_str_t *name);
+
+ngx_int_t ngx_http_minify_file_cache_init_process(ngx_cycle_t *cycle);
+
+ngx_int_t ngx_http_minify_file_cache_open(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+                                          u_char *key, ngx_buf_t **bp);
+
+ngx_int_t ngx_http_minify_file_cache_store(ngx_shm_zone_t *shm_zone, u_char *key,
+                                           u_char *data, size_t len, ngx_pool_t *pool,
+                                           ngx_log_t *log);
+
+ngx_int_t ngx_http_minify_file_cache_exists(ngx_shm_zone_t *shm_zone, u_char *key,
+                                            ngx_pool_t *pool, ngx_log_t *log);
+
+#endif /* _NGX_HTTP_MINIFY_FILE_CACHE_H_INCLUDED_ */
@@ -7,25 +7,288 @@
 #include <ngx_http.h>
 #include "ngx_jsmin.h"
 #include "ngx_cssmin.h"
-#include "ngx_minify_string.h"
+#include "ngx_http_minify_cache.h"
+#include "ngx_http_minify_file_cache.h"
+
+#define NGX_HTTP_MINIFY_JS 1
+#define NGX_HTTP_MINIFY_CSS 2
+
+/* gather chunk size when the upstream does not announce Content-Length,
+ * also the window a spilled body is written and read back through */
+#define NGX_HTTP_MINIFY_GATHER_SIZE 65536
+
+#define NGX_HTTP_MINIFY_TEMP_PATH "minify_temp"
+
+/* ngx_http_minify_filter_ctx_t.status */
+#define NGX_HTTP_MINIFY_MINIFIED 0
+#define NGX_HTTP_MINIFY_PASSED 1
+#define NGX_HTTP_MINIFY_SHED 2
+#define NGX_HTTP_MINIFY_SKIPPED 3
+#define NGX_HTTP_MINIFY_HIT 4
+#define NGX_HTTP_MINIFY_STALE 5
+
+/* how much of the body is looked at to tell whether it is minified already */
+#define NGX_HTTP_MINIFY_SNIFF_SIZE 4096
+#define NGX_HTTP_MINIFY_SNIFF_MIN 512
+
+/* per-worker memory of sniff decisions and savings, by URI */
+#define NGX_HTTP_MINIFY_MEMO_SIZE 4096
+
+/* output at or above this percentage of the input is not worth minifying */
+#define NGX_HTTP_MINIFY_SKIP_RATIO 98
+
+/* how often a request waiting on minify_cache_lock looks at the lock again */
+#define NGX_HTTP_MINIFY_LOCK_POLL 50
+
+#define NGX_HTTP_MINIFY_BUFFERED 0x40
+
+/* part of the ETag, bump when jsmin or cssmin start producing different output */
+#define NGX_HTTP_MINIFY_VERSION "1"
+
+/* minify_preload: files per batch, batch time limit, pause between batches, progress log interval */
+#define NGX_HTTP_MINIFY_PRELOAD_FILES 32
+#define NGX_HTTP_MINIFY_PRELOAD_THRESHOLD 20
+#define NGX_HTTP_MINIFY_PRELOAD_SLEEP 10
+#define NGX_HTTP_MINIFY_PRELOAD_PROGRESS 1000
+
+/*
+ * minify_upstream_cache: put in the cache file header's valid_msec, which
+ * nginx stores and reads back but never sets, of entries holding minified
+ * bytes; outside the millisecond range
+ */
+#define NGX_HTTP_MINIFY_UPSTREAM_MINIFIED 0xf11e
+
+/* minify_thread_pool: tasks a worker may have posted at once by default */
+#define NGX_HTTP_MINIFY_THREAD_QUEUE 32
+
+#define NGX_HTTP_MINIFY_STALE_OFF 0x0001
+#define NGX_HTTP_MINIFY_STALE_UPDATING 0x0002
 
 typedef struct
 {
     ngx_flag_t enable;
+    ngx_flag_t streaming;
+    ngx_bufs_t bufs;
+    size_t max_buffer_size;
+    ngx_path_t *temp_path;
+    off_t min_length;
+    off_t max_length;
+    size_t content_length;
+    ngx_msec_t cpu_budget;
+    ngx_msec_t cpu_deadline;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+#endif
+    size_t thread_min_size;
+    size_t thread_split;
+    ngx_uint_t thread_max_queue;
+    ngx_flag_t sniff;
+    ngx_array_t *skip_uri;
+    ngx_shm_zone_t *cache_zone;
+    ngx_shm_zone_t *cache_file;
+    ngx_http_complex_value_t *cache_key;
+    size_t worker_cache;
+    ngx_uint_t cache_min_uses;
+    ngx_flag_t cache_lock;
+    ngx_flag_t cache_watch;
+    /* minify_cache_watch: the root is watched, so watched hits can be trusted */
+    ngx_flag_t cache_watched;
+    ngx_flag_t cache_content;
+    ngx_flag_t upstream_cache;
+    ngx_uint_t cache_use_stale;
+    ngx_msec_t cache_lock_timeout;
+    ngx_array_t *preload;
     ngx_hash_t types;
     ngx_array_t *types_keys;
 } ngx_http_minify_conf_t;
 
 typedef struct
 {
-    u_int all_end;
-    u_char *body;
-    ngx_buf_t *new_b;
-    u_char *tempChar;
-    u_int content_size;
-    mystring *content_string;
+    ngx_chain_t *in;
+    ngx_chain_t *free;
+    ngx_chain_t *busy;
+    ngx_chain_t *out;
+    ngx_chain_t **last_out;
+
+    ngx_buf_t *in_buf;
+    ngx_buf_t *out_buf;
+
+    /* output written into in_buf itself, trailing the read cursor */
+    ngx_buf_t in_place_buf;
+
+    ngx_uint_t type;
+    ngx_uint_t status;
+    ngx_int_t bufs;
+
+    unsigned streaming : 1;
+    unsigned in_place : 1;
+    unsigned nomem : 1;
+    unsigned flush : 1;
+    unsigned sync : 1;
+    unsigned last_buf : 1;
+    unsigned last_in_chain : 1;
+    unsigned gathered : 1;
+    unsigned started : 1;
+    unsigned passed : 1;
+    unsigned done : 1;
+    unsigned cache_hit : 1;
+    unsigned cache_fill : 1;
+    unsigned cache_sent : 1;
+    unsigned cache_wait : 1;
+    unsigned cache_stale : 1;
+    unsigned cache_content : 1;
+    unsigned delay_header : 1;
+    unsigned on_disk : 1;
+    unsigned reading : 1;
+
+    /* whole-body mode: gather buffer being filled, expected and gathered size */
+    ngx_chain_t **last_in;
+    ngx_buf_t *gather;
+    off_t length;
+    off_t size;
+
+    /* bytes read and written by the engines, for the savings ratio */
+    off_t consumed;
+    off_t produced;
+
+    /*
+     * minify_cache_zone: on a hit the stored output itself, pinned until the
+     * request pool goes away; on a miss a copy of what is sent
+     */
+    u_char cache_key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    u_char cache_name[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    uint32_t cache_path_hash;
+    ngx_atomic_uint_t cache_generation;
+    ngx_str_t cached;
+    ngx_buf_t *cache_buf;
+    /* minify_cache_file: a hit on disk, sent instead of cached */
+    ngx_buf_t *cache_file_buf;
+    ngx_http_minify_cache_hash_t hash;
+    ngx_event_t wait;
+    ngx_msec_t wait_until;
+
+    /* body above minify_max_buffer_size, read back through window */
+    ngx_temp_file_t *temp_file;
+    ngx_buf_t *file_buf;
+    ngx_buf_t *window;
+    /* input not gathered yet while a file buffer is being read */
+    ngx_chain_t *rest;
+
+#if (NGX_THREADS)
+    /* minify_thread_pool: pieces of ctx->in and tasks still running */
+    struct ngx_http_minify_segment_s *segments;
+    ngx_uint_t nsegments;
+    ngx_uint_t pending;
+#endif
+
+    /* minify_upstream_cache: the upstream's own event pipe handlers */
+    ngx_event_pipe_input_filter_pt input_filter;
+    ngx_int_t (*input_filter_init)(void *data);
+
+    ngx_jsmin_ctx_t *jsmin;
+    ngx_cssmin_ctx_t *cssmin;
 } ngx_http_minify_filter_ctx_t;
 
+/*
+ * 每个 worker 在引擎里花掉的时间，按秒清零；rate 是观测到的吞吐量
+ * （字节/毫秒，滑动平均），用来在开始压缩之前估算一个响应要花多久。
+ */
+typedef struct
+{
+    time_t sec;
+    ngx_uint_t used;
+    ngx_uint_t rate;
+    ngx_uint_t shed;
+    time_t logged;
+} ngx_http_minify_cpu_t;
+
+static ngx_http_minify_cpu_t ngx_http_minify_cpu;
+
+#if (NGX_THREADS)
+
+/*
+ * minify_thread_pool：每段一个任务。线程里只读写这里的字段和这一段的引擎，
+ * 不碰请求的内存池，输出缓冲在投递之前就分配好。
+ */
+typedef struct ngx_http_minify_segment_s
+{
+    ngx_http_request_t *request;
+    ngx_http_minify_filter_ctx_t *ctx;
+    ngx_jsmin_ctx_t *jsmin;
+    ngx_cssmin_ctx_t *cssmin;
+    ngx_chain_t *in;
+    /* where a piece cut from the body starts, to minify it again */
+    u_char *start;
+    ngx_buf_t *out;
+    ngx_int_t rc;
+    /* jsmin's theA at the start of the piece */
+    int resume;
+} ngx_http_minify_segment_t;
+
+/* tasks this worker has posted that have not completed yet */
+static ngx_uint_t ngx_http_minify_thread_queued;
+
+#endif
+
+/*
+ * 每个 worker 记住的 URI 判断结果，直接映射，冲突时覆盖。文件的修改时间
+ * 和长度一起比较，文件变了记录就失效。ratio 是压缩后占原文的百分比。
+ */
+typedef struct
+{
+    uint32_t hash;
+    time_t mtime;
+    off_t length;
+    ngx_uint_t ratio;
+} ngx_http_minify_memo_t;
+
+static ngx_http_minify_memo_t ngx_http_minify_memo[NGX_HTTP_MINIFY_MEMO_SIZE];
+
+/* minify_preload：一个目录，以及提供它的 location 的配置 */
+typedef struct
+{
+    ngx_str_t path;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_core_loc_conf_t *clcf;
+} ngx_http_minify_preload_t;
+
+typedef struct
+{
+    ngx_dir_t dir;
+    ngx_str_t path;
+} ngx_http_minify_preload_dir_t;
+
+/*
+ * 0 号 worker 里的预热状态：正在读的目录组成一个栈，每批处理有限个文件，
+ * 批之间回到事件循环。
+ */
+typedef struct
+{
+    ngx_event_t event;
+    ngx_pool_t *pool;
+    ngx_array_t dirs;
+    /* path of the current directory entry, reused */
+    u_char *name;
+    size_t name_size;
+    ngx_http_minify_preload_t *preload;
+    ngx_uint_t next;
+    ngx_msec_t start;
+    ngx_msec_t logged;
+    ngx_uint_t files;
+    ngx_uint_t minified;
+    ngx_uint_t cached;
+    ngx_uint_t large;
+    ngx_uint_t failed;
+    off_t size;
+    off_t produced;
+} ngx_http_minify_preloader_t;
+
+/* minify_preload of the configuration being read, ngx_http_minify_preload_t */
+static ngx_array_t *ngx_http_minify_preloads;
+
+static ngx_path_init_t ngx_http_minify_temp_path = {
+    ngx_string(NGX_HTTP_MINIFY_TEMP_PATH), {1, 2, 0}};
+
 static ngx_str_t ngx_http_minify_default_types[] = {
     ngx_string("application/x-javascript"),
     ngx_string("application/javascript"),
@@ -33,6 +296,17 @@ static ngx_str_t ngx_http_minify_default_types[] = {
     ngx_string("text/css"),
     ngx_null_string};
 
+static ngx_conf_bitmask_t ngx_http_minify_use_stale_mask[] = {
+    {ngx_string("off"), NGX_HTTP_MINIFY_STALE_OFF},
+    {ngx_string("updating"), NGX_HTTP_MINIFY_STALE_UPDATING},
+    {ngx_null_string, 0}};
+
+static char *ngx_http_minify_cpu_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_minify_skip_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_minify_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_minify_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_minify_cache_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
 static ngx_command_t ngx_http_minify_filter_commands[] = {
 
     {ngx_string("minify"),
@@ -42,6 +316,195 @@ static ngx_command_t ngx_http_minify_filter_commands[] = {
      offsetof(ngx_http_minify_conf_t, enable),
      NULL},
 
+    {ngx_string("minify_streaming"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, streaming),
+     NULL},
+
+    {ngx_string("minify_buffers"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_conf_set_bufs_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, bufs),
+     NULL},
+
+    {ngx_string("minify_max_buffer_size"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, max_buffer_size),
+     NULL},
+
+    {ngx_string("minify_temp_path"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+     ngx_conf_set_path_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, temp_path),
+     NULL},
+
+    {ngx_string("minify_min_length"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_off_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, min_length),
+     NULL},
+
+    {ngx_string("minify_max_length"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_off_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, max_length),
+     NULL},
+
+    {ngx_string("minify_content_length"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, content_length),
+     NULL},
+
+    {ngx_string("minify_cpu_budget"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_minify_cpu_budget,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cpu_budget),
+     NULL},
+
+    {ngx_string("minify_cpu_deadline"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cpu_deadline),
+     NULL},
+
+    {ngx_string("minify_thread_pool"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_minify_thread_pool,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+
+    {ngx_string("minify_thread_min_size"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, thread_min_size),
+     NULL},
+
+    {ngx_string("minify_thread_split"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, thread_split),
+     NULL},
+
+    {ngx_string("minify_sniff"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, sniff),
+     NULL},
+
+    {ngx_string("minify_skip_uri"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+     ngx_http_minify_skip_uri,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+
+    {ngx_string("minify_cache_zone"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_minify_cache_zone,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+
+    {ngx_string("minify_cache_path"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+     ngx_http_minify_file_cache_path,
+     0,
+     0,
+     NULL},
+
+    {ngx_string("minify_cache_file"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_minify_cache_file,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+
+    {ngx_string("minify_preload"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_str_array_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, preload),
+     NULL},
+
+    {ngx_string("minify_upstream_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, upstream_cache),
+     NULL},
+
+    {ngx_string("minify_worker_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, worker_cache),
+     NULL},
+
+    {ngx_string("minify_cache_min_uses"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_min_uses),
+     NULL},
+
+    {ngx_string("minify_cache_lock"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_lock),
+     NULL},
+
+    {ngx_string("minify_cache_lock_timeout"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_lock_timeout),
+     NULL},
+
+    {ngx_string("minify_cache_use_stale"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+     ngx_conf_set_bitmask_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_use_stale),
+     &ngx_http_minify_use_stale_mask},
+
+    {ngx_string("minify_cache_watch"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_watch),
+     NULL},
+
+    {ngx_string("minify_cache_content"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_content),
+     NULL},
+
+    {ngx_string("minify_cache_key"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_set_complex_value_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_minify_conf_t, cache_key),
+     NULL},
+
     {ngx_string("minify_types"),
      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
      ngx_http_types_slot,
@@ -51,14 +514,81 @@ static ngx_command_t ngx_http_minify_filter_commands[] = {
 
     ngx_null_command};
 
+static ngx_int_t ngx_http_minify_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_minify_filter_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_minify_init_process(ngx_cycle_t *cycle);
+static void ngx_http_minify_exit_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_minify_upstream_cache_variable(ngx_http_request_t *r,
+                                                        ngx_http_variable_value_t *v, uintptr_t data);
+#if (NGX_HTTP_CACHE)
+static ngx_int_t ngx_http_minify_upstream_cache(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_pipe_init(void *data);
+static ngx_int_t ngx_http_minify_pipe_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
+#endif
+static ngx_int_t ngx_http_minify_preconfiguration(ngx_conf_t *cf);
+static void ngx_http_minify_preload_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_minify_preload_next(ngx_http_minify_preloader_t *pl);
+static ngx_int_t ngx_http_minify_preload_file(ngx_http_minify_preloader_t *pl, ngx_str_t *path);
+static void ngx_http_minify_preload_log(ngx_http_minify_preloader_t *pl, const char *what);
 static void *ngx_http_minify_create_conf(ngx_conf_t *cf);
 static char *ngx_http_minify_merge_conf(ngx_conf_t *cf, void *parent, void *child);
-static ngx_int_t ngx_http_minify_buf_in_memory(ngx_buf_t *buf, ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
-// static u_char *strAddstr(ngx_http_request_t *r, u_char *str1, u_char *str2, ngx_http_minify_filter_ctx_t *ctx);
-static u_char *getChar(ngx_http_request_t *r, u_char *pos, u_char *last);
+static ngx_uint_t ngx_http_minify_engine_type(ngx_http_request_t *r);
+static ngx_int_t ngx_http_minify_engine_run(ngx_http_minify_filter_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out, ngx_uint_t last);
+static ngx_int_t ngx_http_minify_run_all(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx,
+                                         ngx_buf_t *in, ngx_uint_t last, ngx_buf_t **out);
+static ngx_int_t ngx_http_minify_gather(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_minify_gather_buf(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, off_t size);
+static ngx_int_t ngx_http_minify_spill(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_pass(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_minify_exact(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_send_whole(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_minify_thread(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static u_char *ngx_http_minify_split(ngx_uint_t type, u_char *p, u_char *last, int *resume);
+static ngx_int_t ngx_http_minify_stitch(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static void ngx_http_minify_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_minify_thread_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_minify_output(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_uint_t ngx_http_minify_out_of_range(ngx_http_minify_conf_t *conf, off_t size);
+static ngx_uint_t ngx_http_minify_shed(ngx_http_request_t *r, off_t size);
+static void ngx_http_minify_account(ngx_uint_t usec, off_t size);
+static ngx_uint_t ngx_http_minify_usec(void);
+static ngx_uint_t ngx_http_minify_skip(ngx_http_request_t *r, ngx_http_minify_conf_t *conf);
+static ngx_uint_t ngx_http_minify_sniff(ngx_chain_t *in);
+static void ngx_http_minify_remember(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_uint_t ratio);
+static ngx_int_t ngx_http_minify_etag(ngx_http_request_t *r, ngx_uint_t type);
+static ngx_uint_t ngx_http_minify_etag_match(ngx_table_elt_t *header, ngx_str_t *etag);
+static ngx_int_t ngx_http_minify_cache_key(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_cache_find(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_cache_content(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_cache_send(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_minify_cache_collect(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_cache_wait(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_cache_discard(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static void ngx_http_minify_cache_wait_handler(ngx_event_t *ev);
+static void ngx_http_minify_cache_wait_cleanup(void *data);
+static ngx_int_t ngx_http_minify_status_variable(ngx_http_request_t *r,
+                                                 ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_minify_cache_variable(ngx_http_request_t *r,
+                                                ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_minify_read_file(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_read(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx,
+                                      ngx_buf_t *src, ngx_buf_t *dst);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_minify_read_thread_handler(ngx_thread_task_t *task, ngx_file_t *file);
+static void ngx_http_minify_read_event_handler(ngx_event_t *ev);
+#endif
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_http_minify_read_aio_handler(ngx_event_t *ev);
+#endif
+static void ngx_http_minify_read_done(ngx_http_request_t *r);
+static ngx_int_t ngx_http_minify_filter_run(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_minify_filter_get_buf(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_filter_out(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_minify_filter_link(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_buf_t *b);
 static ngx_http_module_t ngx_http_minify_filter_module_ctx = {
-    NULL,                        /* preconfiguration */
+    ngx_http_minify_preconfiguration, /* preconfiguration */
     ngx_http_minify_filter_init, /* postconfiguration */
 
     NULL, /* create main configuration */
@@ -78,20 +608,54 @@ ngx_module_t ngx_http_minify_filter_module = {
     NGX_HTTP_MODULE,                    /* module type */
     NULL,                               /* init master */
     NULL,                               /* init module */
-    NULL,                               /* init process */
+    ngx_http_minify_init_process,       /* init process */
     NULL,                               /* init thread */
     NULL,                               /* exit thread */
-    NULL,                               /* exit process */
+    ngx_http_minify_exit_process,       /* exit process */
     NULL,                               /* exit master */
     NGX_MODULE_V1_PADDING};
 
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
-// static ngx_int_t ngx_http_minify_buf(ngx_buf_t *buf, ngx_http_request_t *r, ngx_open_file_info_t *of);
+
+static ngx_str_t ngx_http_minify_status_name[] = {
+    ngx_string("minified"),
+    ngx_string("passed"),
+    ngx_string("shed"),
+    ngx_string("skipped"),
+    ngx_string("hit"),
+    ngx_string("stale")};
+
+static ngx_http_variable_t ngx_http_minify_vars[] = {
+
+    {ngx_string("minify_status"), NULL,
+     ngx_http_minify_status_variable, 0, NGX_HTTP_VAR_NOHASH, 0},
+
+    {ngx_string("minify_cache_hits"), NULL,
+     ngx_http_minify_cache_variable,
+     offsetof(ngx_http_minify_cache_stats_t, hits), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("minify_cache_misses"), NULL,
+     ngx_http_minify_cache_variable,
+     offsetof(ngx_http_minify_cache_stats_t, misses), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("minify_cache_rejected"), NULL,
+     ngx_http_minify_cache_variable,
+     offsetof(ngx_http_minify_cache_stats_t, rejected), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("minify_cache_hit_ratio"), NULL,
+     ngx_http_minify_cache_variable, (uintptr_t)-1, NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("minify_upstream_cache"), NULL,
+     ngx_http_minify_upstream_cache_variable, 0, 0, 0},
+
+    ngx_http_null_variable};
 
 static ngx_int_t
 ngx_http_minify_header_filter(ngx_http_request_t *r)
 {
+    ngx_int_t rc;
+    ngx_uint_t type, upstream;
     ngx_http_minify_filter_ctx_t *ctx;
     ngx_http_minify_conf_t *conf;
     if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED)
@@ -109,504 +673,4514 @@ ngx_http_minify_header_filter(ngx_http_request_t *r)
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
 
-    if (!conf->enable || (r->headers_out.status != NGX_HTTP_OK && r->headers_out.status != NGX_HTTP_FORBIDDEN && r->headers_out.status != NGX_HTTP_NOT_FOUND) || (r->headers_out.content_encoding && r->headers_out.content_encoding->value.len) || ngx_http_test_content_type(r, &conf->types) == NULL || r->header_only)
+#if (NGX_HTTP_CACHE)
+    if (conf->enable && conf->upstream_cache && r->cached && r->cache
+        && r->cache->valid_msec == NGX_HTTP_MINIFY_UPSTREAM_MINIFIED)
     {
+        /*
+         * minify_upstream_cache: the entry holds what was minified when it
+         * was stored, the cached headers still have the upstream's length
+         * and validators; other entries go through the filter as usual
+         */
+
+        type = ngx_http_minify_engine_type(r);
+
+        if (type && ngx_http_test_content_type(r, &conf->types))
+        {
+            rc = ngx_http_minify_etag(r, type);
+
+            if (rc == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_DONE)
+            {
+                return ngx_http_next_header_filter(r);
+            }
+        }
+
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_minify_filter_ctx_t));
+        if (ctx == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->status = NGX_HTTP_MINIFY_HIT;
+        ctx->passed = 1;
+
+        ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
+
+        ngx_http_clear_content_length(r);
+        r->headers_out.content_length_n = r->cache->length - r->cache->body_start;
+
         return ngx_http_next_header_filter(r);
     }
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_minify_filter_ctx_t));
-    if (ctx == NULL)
+#endif
+
+    if (!conf->enable || (r->headers_out.status != NGX_HTTP_OK && r->headers_out.status != NGX_HTTP_FORBIDDEN && r->headers_out.status != NGX_HTTP_NOT_FOUND) || (r->headers_out.content_encoding && r->headers_out.content_encoding->value.len) || (r->headers_out.content_length_n != -1 && ngx_http_minify_out_of_range(conf, r->headers_out.content_length_n)) || ngx_http_test_content_type(r, &conf->types) == NULL || r->header_only)
     {
-        return NGX_ERROR;
+        return ngx_http_next_header_filter(r);
+    }
+    type = ngx_http_minify_engine_type(r);
+    if (type == 0)
+    {
+        return ngx_http_next_header_filter(r);
     }
-    ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
-    ngx_http_clear_content_length(r);
-    return ngx_http_next_header_filter(r);
-}
-
-static ngx_int_t
-ngx_http_minify_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
-{
-    // ngx_int_t rc;
-    // ngx_str_t *filename;
-    // ngx_uint_t level;
-    ngx_chain_t *cl;
-    // ngx_open_file_info_t of;
-    ngx_http_minify_conf_t *conf;
-    // ngx_http_core_loc_conf_t *ccf;
-    ngx_http_minify_filter_ctx_t *ctx;
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
 
-    if (ctx == NULL)
+    if (ngx_http_minify_skip(r, conf))
     {
-        return ngx_http_next_body_filter(r, in);
+        return ngx_http_next_header_filter(r);
     }
 
-    // ccf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
-    if (!conf->enable)
+    upstream = 0;
+
+#if (NGX_HTTP_CACHE)
+    upstream = (conf->upstream_cache && !r->cached && r->upstream && r->upstream->buffering && r->upstream->cacheable && r->cache && r->upstream->pipe && r->upstream->pipe->input_ctx == r);
+#endif
+
+    rc = ngx_http_minify_etag(r, type);
+
+    if (rc == NGX_ERROR)
     {
-        return ngx_http_next_body_filter(r, in);
+        return NGX_ERROR;
     }
 
-    if (ngx_http_test_content_type(r, &conf->types) == NULL)
+    if (rc == NGX_DONE && !upstream)
     {
-        return ngx_http_next_body_filter(r, in);
+        /* not modified, nothing to minify; a cache fill still minifies */
+
+        return ngx_http_next_header_filter(r);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http minify filter");
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "进来");
-    for (cl = in; cl; cl = cl->next)
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_minify_filter_ctx_t));
+    if (ctx == NULL)
     {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "是否是最后啦(%d)(%d)", cl->buf->last_buf, cl->buf->last_in_chain);
-        //判断是否最后了
-        ctx->all_end = cl->buf->last_buf;
-        ctx->new_b = cl->buf;
-        u_char *now_buffer = getChar(r, ctx->new_b->pos, ctx->new_b->last);
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "获取到newbuffer啦");
-        if (ctx->content_string == NULL)
-        {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "初始化string");
-            initwithstring(r->pool, ctx->content_string, now_buffer);
-        }
-        else
-        {
-            backaddstring(ctx->content_string, now_buffer);
-        }
-
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "组合body啦");
-        // b = cl->buf;
-        // if (cl->buf->in_file)
-        // {
-        //     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
-
-        //     of.read_ahead = ccf->read_ahead;
-        //     of.directio = ccf->directio;
-        //     of.valid = ccf->open_file_cache_valid;
-        //     of.min_uses = ccf->open_file_cache_min_uses;
-        //     of.errors = ccf->open_file_cache_errors;
-        //     of.events = ccf->open_file_cache_events;
-
-        //     filename = &cl->buf->file->name;
-        //     if (ngx_open_cached_file(ccf->open_file_cache, filename, &of, r->pool) != NGX_OK)
-        //     {
-        //         switch (of.err)
-        //         {
-
-        //         case 0:
-        //             return NGX_HTTP_INTERNAL_SERVER_ERROR;
-
-        //         case NGX_ENOENT:
-        //         case NGX_ENOTDIR:
-        //         case NGX_ENAMETOOLONG:
-
-        //             level = NGX_LOG_ERR;
-        //             rc = NGX_HTTP_NOT_FOUND;
-        //             break;
-
-        //         case NGX_EACCES:
-
-        //             level = NGX_LOG_ERR;
-        //             rc = NGX_HTTP_FORBIDDEN;
-        //             break;
-
-        //         default:
-
-        //             level = NGX_LOG_CRIT;
-        //             rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        //             break;
-        //         }
-
-        //         if (rc != NGX_HTTP_NOT_FOUND || ccf->log_not_found)
-        //         {
-        //             ngx_log_error(level, r->connection->log, of.err,
-        //                           "%s \"%V\" failed", of.failed, filename);
-        //         }
-
-        //         return rc;
-        //     }
-
-        //     if (!of.is_file)
-        //     {
-        //         ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-        //                       "\"%V\" is not a regular file", filename);
-        //         return NGX_HTTP_NOT_FOUND;
-        //     }
-
-        //     if (of.size == 0)
-        //     {
-        //         continue;
-        //     }
-
-        //     ngx_http_minify_buf(b, r, &of);
-        // }
-        // else
-        // {
-
-        // if (b->pos == NULL)
-        // {
-        //     continue;
-        // }
-
-        // ngx_http_minify_buf_in_memory(b, r, ctx);
-        // }
-    }
-    if (ctx->all_end)
-    {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "最后重新组合ngx_buf_t(%d)", ctx->content_size);
-        ngx_buf_t *out = ngx_create_temp_buf(r->pool, ctx->content_string->reallength);
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "重新指向pos（%s）", ctx->body);
-        out->pos = ctx->content_string->p;
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "重新指向end");
-        out->end = out->pos;
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "重新组合last(%d)", ngx_strlen(ctx->body));
-        out->last = out->pos + ctx->content_string->reallength;
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "重新组合in->buf(%d)", ngx_strlen(out));
-        in->buf = out;
-        in->next = NULL;
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "压缩代码");
-        ngx_http_minify_buf_in_memory(out, r, ctx);
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "转发");
-        return ngx_http_next_body_filter(r, in);
+        return NGX_ERROR;
     }
-    else
+
+    ctx->type = type;
+    ctx->streaming = conf->streaming;
+    ctx->last_out = &ctx->out;
+    ctx->last_in = &ctx->in;
+    ctx->length = r->headers_out.content_length_n;
+
+#if (NGX_HTTP_CACHE)
+    if (upstream)
     {
-        return NGX_OK;
+        return ngx_http_minify_upstream_cache(r, ctx);
     }
-}
+#endif
 
-/**
- * @brief 获取一段char
- *
- * @param pos
- * @param last
- * @return u_char*
- */
-static u_char *getChar(ngx_http_request_t *r, u_char *pos, u_char *last)
-{
-    u_char *a = pos;
-    int i = 0;
-    for (;;)
+    if (conf->cache_zone || conf->worker_cache || conf->cache_file)
     {
-        if (a >= last)
+        rc = ngx_http_minify_cache_key(r, ctx);
+
+        if (rc == NGX_ERROR)
         {
-            break;
+            return NGX_ERROR;
         }
-        ++a;
-        i++;
-    }
-    u_char *e = (u_char *)minify_pcalloc(r->pool, i + 1);
-    // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "内存分配啦（%d）", ngx_strlen(e));
-    for (i = 0;;)
-    {
-        // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "循环开始啦getChar(%d)", pos - last);
-        if (pos >= last)
+
+        if (rc == NGX_DECLINED && conf->cache_content)
         {
-            // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "跳出了(%d)", i);
-            break;
+            /* no identity to key on, the body hash will be the key */
+
+            ctx->cache_content = 1;
+            ctx->streaming = 0;
+
+            ngx_http_minify_cache_hash_init(&ctx->hash);
+            ngx_http_minify_cache_hash_update(&ctx->hash, (u_char *)&ctx->type, sizeof(ngx_uint_t));
         }
-        // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "还在循环");
-        u_char c = pos[0];
-        // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "获取char");
-        ++pos;
-        // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "增加pos");
-        e[i] = c;
-        // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "赋值给e");
-        i++;
-    }
-    // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "信息返回啦（%d）", ngx_strlen(e));
-
-    return e;
-}
-
-/**
- *  拼接两个char
- *
- */
-// static u_char *strAddstr(ngx_http_request_t *r, u_char *str1, u_char *str2, ngx_http_minify_filter_ctx_t *ctx)
-// {
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "开始拼接啦(%d)(%d)", str1, str2);
-//     // char *str1_ = (char *)str1;
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "转换1(%d)", str1_);
-//     // char *str2_ = (char *)str2;
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "转换2(%d)", str2_);
-//     // int str1_len;
-//     // if (str1_ == 0)
-//     // {
-//     //     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "唉呀str1 0");
-//     //     str1_len = 0;
-//     // }
-//     // else
-//     // {
-//     //     str1_len = strlen(str1_);
-//     //     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "str1的长度是(%d)", str1_len);
-//     // }
-//     // int str2_len;
-//     // if (str2_ == 0)
-//     // {
-//     //     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "唉呀str2 0");
-//     //     str2_len = 0;
-//     // }
-//     // else
-//     // {
-//     //     str2_len = strlen(str2_);
-//     //     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "str2的长度是(%d)", str2_len);
-//     // }
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "两个char都转换完了(%d)(%d)", str1_len, str2_len);
-//     // if (str2_len == 0 && str1_len == 0)
-//     // {
-//     //     return str1;
-//     // }
-//     int str1_len, str2_len;
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "获取长度");
-
-//     /* Find the current size of tokens1 and tokens 2 */
-//     if (NULL != str2)
-//     {
-//         // for (str2_len = 0; str2[str2_len] != '\0'; str2_len++)
-//         //     ;
-//         str2_len = ngx_strlen(str2);
-//     }
-//     else
-//     {
-//         return str1;
-//     }
-
-//     // ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "获取完成");
-//     if (NULL != str1)
-//     {
-//         // for (str1_len = 0; (str1[str1_len] != '\0'); str1_len++)
-//         //     ;
-//         str1_len = ngx_strlen(str1);
-//     }
-//     else
-//     {
-//         str1_len = 0;
-//     }
-
-//     u_char *str3 = (u_char *)minify_pcalloc(r->pool, 1 + str1_len + str2_len);
-//     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "创建str3(%d)(%d)", str1_len, ctx->content_size);
-//     ctx->content_size = ctx->content_size + 1 + str1_len + str2_len;
-//     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "创建str3(%s)", str3);
-
-//     if (str1_len > 0)
-//     {
-//         ngx_memcpy(str3, str1, str1_len * sizeof(u_char *));
-//     }
-
-//     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "第一个拷贝完了");
-//     if (str2_len > 0)
-//     {
-//         ngx_memcpy(str3 + str1_len, str2, str2_len * sizeof(u_char *));
-//     }
-//     // strcat(str1_, str2_);
-//     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "拼接成功啦");
-//     str3[str1_len + str2_len] = '\0';
-//     ctx->tempChar = str3;
-//     ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "赋值成功啦(%s)", ctx->tempChar);
-//     return ctx->tempChar;
-// }
-static ngx_int_t
-ngx_http_minify_buf_in_memory(ngx_buf_t *buf, ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
-{
-    ngx_buf_t *b = NULL, *dst = NULL, *min_dst = NULL;
-    ngx_int_t size;
-
-    size = buf->end - buf->start;
-
-    dst = buf;
-    dst->end[0] = 0;
-
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL)
-    {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
 
-    b->start = ngx_palloc(r->pool, size);
-    b->pos = b->start;
-    b->last = b->start;
-    b->end = b->last + size;
-    b->temporary = 1;
+        if (rc == NGX_OK || rc == NGX_DONE)
+        {
+            /* NGX_DONE: found by minify_cache_watch already */
 
-    min_dst = b;
-    const char *header_content_type = (const char *)r->headers_out.content_type.data;
-    if (strstr(header_content_type, (const char *)ngx_http_minify_default_types[0].data) != 0 ||
-        strstr(header_content_type, (const char *)ngx_http_minify_default_types[1].data) != 0 ||
-        strstr(header_content_type, (const char *)ngx_http_minify_default_types[2].data) != 0)
-    {
-        jsmin(dst, min_dst);
-    }
-    else if (strstr(header_content_type, (const char *)ngx_http_minify_default_types[3].data) != 0)
-    {
-        cssmin(dst, min_dst);
-    }
-    else
-    {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+            rc = (rc == NGX_DONE) ? NGX_OK : ngx_http_minify_cache_find(r, ctx);
 
-    buf->start = min_dst->start;
-    buf->pos = min_dst->pos;
-    buf->last = min_dst->last;
-    buf->end = min_dst->end;
-    buf->memory = 1;
-    buf->in_file = 0;
+            if (rc == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
 
-    return NGX_OK;
-}
+            if (rc == NGX_OK)
+            {
+                /* the body is never looked at, so it can stay in the file */
 
-// static ngx_int_t
-// ngx_http_minify_buf(ngx_buf_t *buf, ngx_http_request_t *r,
-//                     ngx_open_file_info_t *of)
-// {
-//     ngx_buf_t *b = NULL, *dst = NULL, *min_dst = NULL;
-//     ngx_int_t size;
-//     ngx_file_t *src_file;
-
-//     src_file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-//     if (src_file == NULL)
-//     {
-//         return NGX_HTTP_INTERNAL_SERVER_ERROR;
-//     }
-
-//     src_file->fd = of->fd;
-//     src_file->name = buf->file->name;
-//     src_file->log = r->connection->log;
-//     src_file->directio = of->is_directio;
-
-//     size = of->size;
-
-//     b = ngx_calloc_buf(r->pool);
-//     if (b == NULL)
-//     {
-//         return NGX_HTTP_INTERNAL_SERVER_ERROR;
-//     }
-
-//     b->start = ngx_palloc(r->pool, size + 1);
-//     b->pos = b->start;
-//     b->last = b->start;
-//     b->end = b->last + size;
-//     b->temporary = 1;
-
-//     dst = b;
-
-// #if (NGX_HAVE_FILE_AIO)
-//     ssize_t n;
-//     ngx_output_chain_ctx_t *ctx;
-//     ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
-//     if (ctx->aio_handler)
-//     {
-//         n = ngx_file_aio_read(src_file, dst->pos, (size_t)size, 0,
-//                               ctx->pool);
-
-//         if (n == NGX_AGAIN)
-//         {
-//             ctx->aio_handler(ctx, src_file);
-//             return NGX_AGAIN;
-//         }
-//     }
-//     else
-//     {
-//         n = ngx_read_file(src_file, dst->pos, (size_t)size, 0);
-//     }
-// #else
-
-//     ngx_read_file(src_file, dst->pos, (size_t)size, 0);
-// #endif
-
-//     dst->end[0] = 0;
-
-//     b = ngx_calloc_buf(r->pool);
-//     if (b == NULL)
-//     {
-//         return NGX_HTTP_INTERNAL_SERVER_ERROR;
-//     }
-
-//     b->start = ngx_palloc(r->pool, size);
-//     b->pos = b->start;
-//     b->last = b->start;
-//     b->end = b->last + size;
-//     b->temporary = 1;
-
-//     min_dst = b;
-//     const char *header_content_type = (const char *)r->headers_out.content_type.data;
-//     if (strstr(header_content_type, (const char *)ngx_http_minify_default_types[0].data) != 0 ||
-//         strstr(header_content_type, (const char *)ngx_http_minify_default_types[1].data) != 0 ||
-//         strstr(header_content_type, (const char *)ngx_http_minify_default_types[2].data) != 0)
-//     {
-//         jsmin(dst, min_dst);
-//     }
-//     else if (strstr(header_content_type, (const char *)ngx_http_minify_default_types[3].data) != 0)
-//     {
-//         cssmin(dst, min_dst);
-//     }
-//     else
-//     {
-//         return NGX_HTTP_INTERNAL_SERVER_ERROR;
-//     }
-
-//     buf->start = min_dst->start;
-//     buf->pos = min_dst->pos;
-//     buf->last = min_dst->last;
-//     buf->end = min_dst->end;
-//     buf->memory = 1;
-//     buf->in_file = 0;
-
-//     return NGX_OK;
-// }
+                ctx->cache_hit = 1;
+                ctx->status = NGX_HTTP_MINIFY_HIT;
 
-static void *
-ngx_http_minify_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_minify_conf_t *conf;
+                ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
+                ngx_http_clear_content_length(r);
+                r->headers_out.content_length_n = ctx->cached.len;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_minify_conf_t));
-    if (conf == NULL)
+                /* the range body filter runs before us, on the original */
+                r->allow_ranges = 0;
+
+                return ngx_http_next_header_filter(r);
+            }
+
+            ctx->cache_fill = 1;
+
+            if ((conf->cache_use_stale & NGX_HTTP_MINIFY_STALE_UPDATING) && conf->cache_zone && r == r->main)
+            {
+                rc = ngx_http_minify_cache_lookup_stale(conf->cache_zone, ctx->cache_name,
+                                                        r->pool, &ctx->cached);
+
+                if (rc == NGX_OK)
+                {
+                    ctx->status = NGX_HTTP_MINIFY_STALE;
+
+                    /* the validators are the new version's, not of the bytes sent */
+
+                    ngx_http_clear_etag(r);
+                    ngx_http_clear_last_modified(r);
+
+                    rc = ngx_http_minify_cache_lock(conf->cache_zone, ctx->cache_key, r->pool,
+                                                    conf->cache_lock_timeout);
+
+                    if (rc == NGX_OK)
+                    {
+                        /* this request minifies the new version, the client gets the old */
+
+                        ctx->cache_stale = 1;
+                    }
+                    else
+                    {
+                        ctx->cache_hit = 1;
+                        ctx->cache_fill = 0;
+
+                        ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
+                        ngx_http_clear_content_length(r);
+                        r->headers_out.content_length_n = ctx->cached.len;
+                        r->allow_ranges = 0;
+
+                        return (rc == NGX_ERROR) ? NGX_ERROR : ngx_http_next_header_filter(r);
+                    }
+                }
+
+                if (rc == NGX_ERROR)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            if (conf->cache_lock && conf->cache_zone && r == r->main && !ctx->cache_stale)
+            {
+                rc = ngx_http_minify_cache_lock(conf->cache_zone, ctx->cache_key, r->pool,
+                                                conf->cache_lock_timeout);
+
+                if (rc == NGX_ERROR)
+                {
+                    return NGX_ERROR;
+                }
+
+                if (rc == NGX_BUSY)
+                {
+                    /* gather the body, by then the entry may be there */
+
+                    ctx->cache_wait = 1;
+                    ctx->streaming = 0;
+                    ctx->wait_until = ngx_current_msec + conf->cache_lock_timeout;
+                }
+            }
+        }
+    }
+
+    if (type == NGX_HTTP_MINIFY_CSS)
     {
-        return NULL;
+        ctx->cssmin = cssmin_create(r->pool);
+        if (ctx->cssmin == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+    else
+    {
+        ctx->jsmin = jsmin_create(r->pool);
+        if (ctx->jsmin == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
+    ngx_http_clear_content_length(r);
+    r->allow_ranges = 0;
+
+    if (ctx->cache_stale)
+    {
+        r->headers_out.content_length_n = ctx->cached.len;
     }
 
     /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->bufs.num = 0;
-     *     conf->types = { NULL };
-     *     conf->types_keys = NULL;
+     * minify_content_length: a small body is minified whole before the
+     * header goes out, so it can carry the exact length; a HEAD request
+     * only gets a body to minify from the static handler
      */
 
-    conf->enable = NGX_CONF_UNSET;
+    if (conf->content_length && r == r->main && !ctx->cache_stale
+        && (ctx->length == -1 ? !ctx->streaming : ctx->length <= (off_t)conf->content_length)
+        && (r->method != NGX_HTTP_HEAD || r->upstream == NULL))
+    {
+        ctx->delay_header = 1;
+        ctx->streaming = 0;
 
-    return conf;
+        return NGX_OK;
+    }
+
+    return ngx_http_next_header_filter(r);
 }
 
-static char *
-ngx_http_minify_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+static ngx_int_t
+ngx_http_minify_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    ngx_http_minify_conf_t *prev = parent;
-    ngx_http_minify_conf_t *conf = child;
+    ngx_int_t rc;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_minify_filter_ctx_t *ctx;
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
 
-    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
-                             &prev->types_keys, &prev->types,
-                             ngx_http_minify_default_types) != NGX_OK)
+    if (ctx == NULL || ctx->passed)
     {
-        return NGX_CONF_ERROR;
+        return ngx_http_next_body_filter(r, in);
     }
 
-    return NGX_CONF_OK;
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+    if (!conf->enable)
+    {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (ngx_http_test_content_type(r, &conf->types) == NULL)
+    {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify filter");
+
+    if (ctx->cache_hit)
+    {
+        return ngx_http_minify_cache_send(r, ctx, in);
+    }
+
+    if (ctx->cache_stale && !ctx->cache_sent)
+    {
+        /* the old version goes out first, the new one only to the cache */
+
+        if (ngx_http_minify_cache_send(r, ctx, NULL) == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!ctx->streaming && !ctx->gathered)
+    {
+        rc = ngx_http_minify_gather(r, ctx, in);
+
+        if (rc == NGX_ERROR || ctx->passed)
+        {
+            return rc;
+        }
+
+        if (!ctx->gathered)
+        {
+            return rc;
+        }
+
+        in = NULL;
+    }
+
+    if (ctx->cache_content)
+    {
+        ctx->cache_content = 0;
+
+        rc = ngx_http_minify_cache_content(r, ctx);
+
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+    }
+
+    if (ctx->cache_wait)
+    {
+        rc = ngx_http_minify_cache_wait(r, ctx);
+
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+    }
+
+    if (!ctx->started)
+    {
+        /* the whole body is known here unless streaming */
+
+        ctx->started = 1;
+
+        if (ngx_http_minify_shed(r, ctx->streaming ? ctx->length : ctx->size))
+        {
+            ctx->status = NGX_HTTP_MINIFY_SHED;
+            return ngx_http_minify_pass(r, ctx, in);
+        }
+
+        if (conf->sniff && ngx_http_minify_sniff(ctx->streaming ? in : ctx->in))
+        {
+            ngx_http_minify_remember(r, ctx, 100);
+
+            ctx->status = NGX_HTTP_MINIFY_SKIPPED;
+            return ngx_http_minify_pass(r, ctx, in);
+        }
+    }
+
+#if (NGX_THREADS)
+    if (conf->thread_pool && ctx->gathered && !ctx->done && !ctx->on_disk
+        && ctx->size >= (off_t)conf->thread_min_size)
+    {
+        return ngx_http_minify_thread(r, ctx);
+    }
+#endif
+
+    if (ctx->delay_header && !ctx->on_disk && ctx->size <= (off_t)conf->content_length)
+    {
+        return ngx_http_minify_exact(r, ctx);
+    }
+
+    return ngx_http_minify_filter_run(r, ctx, in);
 }
 
+/*
+ * 收集整个响应体。每个字节只拷贝一次：长度已知时预先分配一整块，
+ * 未知时按 NGX_HTTP_MINIFY_GATHER_SIZE 追加新块，拷贝后把输入标记为已消费，
+ * 上游可以立即复用它的缓冲。收集到的块直接挂在 ctx->in 上交给引擎。
+ * 超过 minify_max_buffer_size 的响应体写入 minify_temp_path 下的临时文件，
+ * 内存里只留一个窗口缓冲，最后以 in_file 缓冲交给引擎，分窗口读回。
+ * 文件缓冲（静态文件、写到磁盘上的上游响应）由 ngx_http_minify_read 读进
+ * 收集缓冲；整个响应体就是一个超过 minify_max_buffer_size 的文件时不再拷贝，
+ * 直接从这个文件分窗口读。读文件挂起时剩下的输入留在 ctx->rest 里。
+ * 没有 Content-Length 时在这里检查 minify_min_length/minify_max_length，
+ * 超出范围就把收集到的内容原样发出去。
+ */
 static ngx_int_t
-ngx_http_minify_filter_init(ngx_conf_t *cf)
+ngx_http_minify_gather(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in)
 {
-    ngx_http_next_header_filter = ngx_http_top_header_filter;
-    ngx_http_top_header_filter = ngx_http_minify_header_filter;
+    off_t size;
+    u_char *p;
+    ngx_int_t rc;
+    ngx_buf_t *b, *g;
+    ngx_chain_t *cl;
+    ngx_http_minify_conf_t *conf;
 
-    ngx_http_next_body_filter = ngx_http_top_body_filter;
-    ngx_http_top_body_filter = ngx_http_minify_body_filter;
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (ctx->rest)
+    {
+        if (in && ngx_chain_add_copy(r->pool, &ctx->rest, in) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        in = ctx->rest;
+        ctx->rest = NULL;
+    }
+
+    if (ctx->reading)
+    {
+        return (ngx_chain_add_copy(r->pool, &ctx->rest, in) == NGX_OK) ? NGX_AGAIN : NGX_ERROR;
+    }
+
+    for (/* void */; in; in = in->next)
+    {
+        b = in->buf;
+
+        if (ctx->in == NULL && ctx->temp_file == NULL && (b->last_buf || b->last_in_chain))
+        {
+            if (ngx_http_minify_out_of_range(conf, ngx_buf_size(b)))
+            {
+                return ngx_http_minify_pass(r, ctx, in);
+            }
+
+            /*
+             * the whole body is in this buffer, minify it where it is;
+             * a file that fits is read whole into memory below, as is one
+             * whose content has to be hashed
+             */
+
+            if (ngx_buf_in_memory(b) || !b->in_file
+                || (!ctx->cache_content && ngx_buf_size(b) > (off_t)conf->max_buffer_size))
+            {
+                if (ctx->cache_content && ngx_buf_in_memory(b))
+                {
+                    ngx_http_minify_cache_hash_update(&ctx->hash, b->pos, b->last - b->pos);
+                }
+
+                ctx->size = ngx_buf_size(b);
+                ctx->gathered = 1;
+                ctx->on_disk = !ngx_buf_in_memory(b);
+                return ngx_chain_add_copy(r->pool, &ctx->in, in);
+            }
+        }
+
+        if (conf->max_length && ctx->size + ngx_buf_size(b) > conf->max_length)
+        {
+            return ngx_http_minify_pass(r, ctx, in);
+        }
+
+        while (ngx_buf_in_memory(b) && b->pos < b->last)
+        {
+            g = ctx->gather;
+
+            if (g == NULL || g->last == g->end)
+            {
+                if (ngx_http_minify_gather_buf(r, ctx, b->last - b->pos) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                g = ctx->gather;
+            }
+
+            size = ngx_min(b->last - b->pos, g->end - g->last);
+
+            if (ctx->cache_content)
+            {
+                ngx_http_minify_cache_hash_update(&ctx->hash, b->pos, (size_t)size);
+            }
+
+            g->last = ngx_cpymem(g->last, b->pos, (size_t)size);
+            b->pos += size;
+            ctx->size += size;
+        }
+
+        while (!ngx_buf_in_memory(b) && b->in_file && b->file_pos < b->file_last)
+        {
+            g = ctx->gather;
+
+            if (g == NULL || g->last == g->end)
+            {
+                if (ngx_http_minify_gather_buf(r, ctx, b->file_last - b->file_pos) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                g = ctx->gather;
+            }
+
+            p = g->last;
+
+            rc = ngx_http_minify_read(r, ctx, b, g);
+
+            if (rc == NGX_AGAIN)
+            {
+                return (ngx_chain_add_copy(r->pool, &ctx->rest, in) == NGX_OK) ? NGX_AGAIN : NGX_ERROR;
+            }
+
+            if (rc != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            if (ctx->cache_content)
+            {
+                ngx_http_minify_cache_hash_update(&ctx->hash, p, g->last - p);
+            }
+
+            ctx->size += g->last - p;
+        }
+
+        if ((b->last_buf || b->last_in_chain) && ctx->size < conf->min_length)
+        {
+            /* the flags go on an empty buffer after what was gathered */
+
+            g = ngx_calloc_buf(r->pool);
+            if (g == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            g->last_buf = b->last_buf;
+            g->last_in_chain = b->last_in_chain;
+            g->sync = b->sync;
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            cl->buf = g;
+            cl->next = NULL;
+            *ctx->last_in = cl;
+
+            return ngx_http_minify_pass(r, ctx, NULL);
+        }
+
+        if (b->last_buf || b->last_in_chain)
+        {
+            if (ctx->temp_file)
+            {
+                if (ngx_http_minify_spill(r, ctx) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                g = ngx_calloc_buf(r->pool);
+                if (g == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                g->in_file = 1;
+                g->file = &ctx->temp_file->file;
+                g->file_pos = 0;
+                g->file_last = ctx->temp_file->offset;
+
+                ctx->in->buf = g;
+                ctx->gather = g;
+                ctx->on_disk = 1;
+            }
+
+            g = ctx->gather;
+
+            if (g == NULL)
+            {
+                g = ngx_calloc_buf(r->pool);
+                if (g == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                cl = ngx_alloc_chain_link(r->pool);
+                if (cl == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = g;
+                cl->next = NULL;
+                *ctx->last_in = cl;
+            }
+
+            g->last_buf = b->last_buf;
+            g->last_in_chain = b->last_in_chain;
+            g->sync = b->sync;
+
+            ctx->gathered = 1;
+
+            return NGX_OK;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_gather_buf(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, off_t size)
+{
+    ngx_buf_t *g;
+    ngx_chain_t *cl;
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (ctx->temp_file || ngx_max(ctx->length, ctx->size + size) > (off_t)conf->max_buffer_size)
+    {
+        return ngx_http_minify_spill(r, ctx);
+    }
+
+    if (ctx->length > ctx->size + size)
+    {
+        size = ctx->length - ctx->size;
+    }
+    else if (ctx->length < 0)
+    {
+        size = ngx_max(size, NGX_HTTP_MINIFY_GATHER_SIZE);
+    }
+
+    g = ngx_create_temp_buf(r->pool, (size_t)size);
+    if (g == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cl->buf = g;
+    cl->next = NULL;
+    *ctx->last_in = cl;
+    ctx->last_in = &cl->next;
+
+    ctx->gather = g;
 
     return NGX_OK;
 }
+
+/*
+ * 放弃压缩：已写入临时文件的部分、收集缓冲和剩下的输入按原顺序发出，
+ * 之后的调用直接透传。
+ */
+static ngx_int_t
+ngx_http_minify_pass(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_buf_t *b;
+    ngx_chain_t *cl;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify pass through after %O bytes", ctx->size);
+
+    if (ctx->cache_stale)
+    {
+        /* the client already has the old version, drop the rest */
+
+        ctx->cache_hit = 1;
+        ctx->cache_fill = 0;
+
+        if (in && ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        return ngx_http_minify_cache_send(r, ctx, ctx->in);
+    }
+
+    ctx->passed = 1;
+
+    if (ctx->status == NGX_HTTP_MINIFY_MINIFIED)
+    {
+        ctx->status = NGX_HTTP_MINIFY_PASSED;
+    }
+
+    if (ctx->delay_header)
+    {
+        /* the header has not gone out yet, the body is the original one */
+
+        r->headers_out.content_length_n = ctx->length;
+    }
+
+    if (ctx->temp_file && ctx->temp_file->offset && !ctx->gathered)
+    {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        b->in_file = 1;
+        b->file = &ctx->temp_file->file;
+        b->file_pos = 0;
+        b->file_last = ctx->temp_file->offset;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = ctx->in;
+        ctx->in = cl;
+    }
+
+    if (in && ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_minify_output(r, ctx, ctx->in);
+}
+
+/*
+ * 收集到的响应体一次压缩完，输出放在一个缓冲里发出。
+ */
+static ngx_int_t
+ngx_http_minify_exact(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+    ngx_buf_t *b, *out;
+    ngx_uint_t usec;
+    ngx_chain_t *cl;
+
+    out = NULL;
+    rc = NGX_AGAIN;
+    usec = ngx_http_minify_usec();
+
+    for (cl = ctx->in; cl && rc == NGX_AGAIN; cl = cl->next)
+    {
+        b = cl->buf;
+        rc = ngx_http_minify_run_all(r, ctx, b, b->last_buf || b->last_in_chain, &out);
+    }
+
+    ngx_http_minify_account(ngx_http_minify_usec() - usec, ctx->size);
+
+    if (rc != NGX_OK || out == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "minify of %O bytes failed", ctx->size);
+        return NGX_ERROR;
+    }
+
+    ctx->produced = out->last - out->pos;
+
+    if (ctx->produced && ngx_http_minify_filter_link(r, ctx, out) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_minify_send_whole(r, ctx);
+}
+
+/*
+ * 整个响应体的输出已经挂在 ctx->out 上，总长 ctx->produced。
+ * minify_content_length 推迟了响应头时，按这个长度设置 Content-Length，
+ * 连同响应头一起发出。
+ */
+static ngx_int_t
+ngx_http_minify_send_whole(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t *cl;
+    ngx_http_minify_conf_t *conf;
+
+    for (cl = ctx->in; cl; cl = cl->next)
+    {
+        b = cl->buf;
+
+        if (b->last_buf || b->last_in_chain)
+        {
+            ctx->last_buf = b->last_buf;
+            ctx->last_in_chain = b->last_in_chain;
+        }
+
+        b->pos = b->last;
+    }
+
+    ctx->in = NULL;
+    ctx->done = 1;
+    ctx->consumed = ctx->size;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (conf->sniff && ctx->consumed)
+    {
+        ngx_http_minify_remember(r, ctx, (ngx_uint_t)(ctx->produced * 100 / ctx->consumed));
+    }
+
+    if (ctx->delay_header)
+    {
+        r->headers_out.content_length_n = ctx->produced;
+    }
+
+    if (ctx->out == NULL)
+    {
+        /* an empty temporary buffer would upset the writer */
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_minify_filter_link(r, ctx, b) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    for (cl = ctx->out; cl->next; cl = cl->next)
+    {
+        /* void */
+    }
+
+    cl->buf->last_buf = ctx->last_buf;
+    cl->buf->last_in_chain = ctx->last_in_chain;
+
+    if (ctx->cache_fill && ngx_http_minify_cache_collect(r, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->cache_stale)
+    {
+        return ngx_http_minify_cache_discard(r, ctx);
+    }
+
+    rc = ngx_http_minify_output(r, ctx, ctx->out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                            (ngx_buf_tag_t)&ngx_http_minify_filter_module);
+    ctx->last_out = &ctx->out;
+
+    return rc;
+}
+
+#if (NGX_THREADS)
+
+/*
+ * minify_thread_pool：大的响应体交给线程池压缩，请求挂起（blocked，
+ * c->buffered），任务全部完成后投递写事件，nginx 再次调用过滤器时合并发出。
+ * 本 worker 未完成的任务达到 max_queue 时不排队，原样发送。
+ * minify_thread_split：响应体在一个连续缓冲里时，按大约这个大小切成几段，
+ * 每段一个任务，各用一个引擎，第一段之后的引擎从猜测的切分点状态开始。
+ */
+static ngx_int_t
+ngx_http_minify_thread(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    off_t step;
+    u_char *p, *end;
+    ngx_buf_t *b;
+    ngx_uint_t i, n;
+    ngx_chain_t *cl;
+    ngx_connection_t *c;
+    ngx_thread_task_t *task;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_minify_segment_t *seg;
+
+    c = r->connection;
+
+    if (ctx->segments)
+    {
+        if (ctx->pending)
+        {
+            return NGX_AGAIN;
+        }
+
+        c->buffered &= ~NGX_HTTP_MINIFY_BUFFERED;
+
+        return ngx_http_minify_stitch(r, ctx);
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (ngx_http_minify_thread_queued >= conf->thread_max_queue)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http minify thread queue full, %ui tasks",
+                       ngx_http_minify_thread_queued);
+
+        ctx->status = NGX_HTTP_MINIFY_SHED;
+        return ngx_http_minify_pass(r, ctx, NULL);
+    }
+
+    n = 1;
+    b = ctx->in->buf;
+
+    if (conf->thread_split && ctx->in->next == NULL && ngx_buf_in_memory(b)
+        && ctx->size >= 2 * (off_t)conf->thread_split)
+    {
+        n = (ngx_uint_t)(ctx->size / (off_t)conf->thread_split);
+        n = ngx_min(n, conf->thread_max_queue - ngx_http_minify_thread_queued);
+    }
+
+    seg = ngx_pcalloc(r->pool, n * sizeof(ngx_http_minify_segment_t));
+    if (seg == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (n == 1)
+    {
+        /* the whole chain in one task, with the request's own engine */
+
+        seg[0].in = ctx->in;
+    }
+    else
+    {
+        step = ctx->size / n;
+        p = b->pos;
+
+        for (i = 0; i < n; i++)
+        {
+            end = NULL;
+
+            if (i < n - 1 && b->last - p > step)
+            {
+                end = ngx_http_minify_split(ctx->type, p + step, b->last, &seg[i + 1].resume);
+            }
+
+            if (end == NULL)
+            {
+                /* no place to cut, this one takes the rest */
+
+                end = b->last;
+                n = i + 1;
+            }
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            cl->buf = ngx_calloc_buf(r->pool);
+            if (cl->buf == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            cl->buf->pos = p;
+            cl->buf->last = end;
+            cl->buf->memory = 1;
+            cl->next = NULL;
+
+            if (end == b->last)
+            {
+                cl->buf->last_buf = b->last_buf;
+                cl->buf->last_in_chain = b->last_in_chain;
+            }
+
+            seg[i].in = cl;
+            seg[i].start = p;
+
+            if (i == 0)
+            {
+                /* void */
+            }
+            else if (ctx->type == NGX_HTTP_MINIFY_CSS)
+            {
+                seg[i].cssmin = cssmin_create(r->pool);
+                if (seg[i].cssmin == NULL)
+                {
+                    return NGX_ERROR;
+                }
+            }
+            else
+            {
+                seg[i].jsmin = jsmin_create(r->pool);
+                if (seg[i].jsmin == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                jsmin_resume(seg[i].jsmin, seg[i].resume);
+            }
+
+            p = end;
+        }
+    }
+
+    seg[0].jsmin = ctx->jsmin;
+    seg[0].cssmin = ctx->cssmin;
+
+    ctx->segments = seg;
+    ctx->nsegments = n;
+
+    for (i = 0; i < n; i++)
+    {
+        seg[i].request = r;
+        seg[i].ctx = ctx;
+        seg[i].rc = NGX_DECLINED;
+
+        /* minified output is rarely longer than the input */
+
+        seg[i].out = ngx_create_temp_buf(r->pool, (n == 1) ? (size_t)ngx_max(ctx->size, 64)
+                                                           : (size_t)ngx_max(seg[i].in->buf->last - seg[i].start, 64));
+        if (seg[i].out == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        task = ngx_thread_task_alloc(r->pool, 0);
+        if (task == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        seg[i].rc = NGX_AGAIN;
+
+        task->ctx = &seg[i];
+        task->handler = ngx_http_minify_thread_handler;
+        task->event.handler = ngx_http_minify_thread_event_handler;
+        task->event.data = &seg[i];
+
+        if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK)
+        {
+            /* the segments left are minified here when the rest is done */
+
+            seg[i].rc = NGX_DECLINED;
+
+            if (i == 0)
+            {
+                return NGX_ERROR;
+            }
+
+            break;
+        }
+
+        ctx->pending++;
+        ngx_http_minify_thread_queued++;
+        r->main->blocked++;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http minify thread: %O bytes in %ui tasks", ctx->size, ctx->pending);
+
+    c->buffered |= NGX_HTTP_MINIFY_BUFFERED;
+
+    return NGX_AGAIN;
+}
+
+/*
+ * 找切分点：从 p 开始第一个去掉行尾空白后以 '}' 结尾（JavaScript 也可以是
+ * ';'）的行，返回下一行的开头，*resume 是 jsmin 读完这个换行后的 theA。
+ * 这只是猜测，字符串、正则、注释里的行也会被选中，合并时按引擎的状态核对。
+ */
+static u_char *
+ngx_http_minify_split(ngx_uint_t type, u_char *p, u_char *last, int *resume)
+{
+    u_char *q, *nl;
+
+    while (p < last)
+    {
+        nl = ngx_strlchr(p, last, '\n');
+
+        if (nl == NULL || nl + 1 == last)
+        {
+            return NULL;
+        }
+
+        for (q = nl; q > p && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r'); q--)
+        {
+            /* void */
+        }
+
+        if (q > p && (q[-1] == '}' || (type == NGX_HTTP_MINIFY_JS && q[-1] == ';')))
+        {
+            /* "}" is written out at the linefeed, ";" is held as theA */
+
+            *resume = (q[-1] == ';') ? ';' : '\n';
+            return nl + 1;
+        }
+
+        p = nl + 1;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_minify_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_minify_segment_t *seg = data;
+
+    ngx_buf_t *b;
+    ngx_uint_t last;
+    ngx_chain_t *cl;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "http minify thread");
+
+    for (cl = seg->in; cl && seg->rc == NGX_AGAIN; cl = cl->next)
+    {
+        b = cl->buf;
+        last = b->last_buf || b->last_in_chain;
+
+        if (seg->cssmin)
+        {
+            seg->cssmin->last = last;
+            seg->cssmin->in_place = 0;
+            seg->rc = cssmin(seg->cssmin, b, seg->out);
+        }
+        else
+        {
+            seg->jsmin->last = last;
+            seg->jsmin->in_place = 0;
+            seg->rc = jsmin(seg->jsmin, b, seg->out);
+        }
+    }
+}
+
+static void
+ngx_http_minify_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_minify_segment_t *seg = ev->data;
+
+    ngx_http_request_t *r;
+
+    r = seg->request;
+
+    ngx_http_minify_thread_queued--;
+    r->main->blocked--;
+
+    if (--seg->ctx->pending == 0)
+    {
+        /* the writer calls the filter chain again */
+
+        ngx_post_event(r->connection->write, &ngx_posted_events);
+    }
+}
+
+/*
+ * 按顺序合并各段的输出。前一段的引擎停下时的状态（第一段是真实状态，
+ * 之后每段核对通过也就是真实状态）和下一段开始时猜的状态一致，
+ * 下一段的输出就和单线程压缩的完全相同，接着用它的引擎；不一致（切在了
+ * 字符串、正则或注释里）或者这段没能投递，就用前一段的引擎把这段重新
+ * 压缩一遍。输出缓冲不够时也在这里接着做。
+ */
+static ngx_int_t
+ngx_http_minify_stitch(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    off_t size, redone;
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_uint_t i, usec, same;
+    ngx_chain_t *cl;
+    ngx_http_minify_segment_t *seg;
+
+    redone = 0;
+    usec = ngx_http_minify_usec();
+
+    for (i = 0; i < ctx->nsegments; i++)
+    {
+        seg = &ctx->segments[i];
+
+        if (i == 0)
+        {
+            same = 1;
+        }
+        else if (ctx->type == NGX_HTTP_MINIFY_CSS)
+        {
+            same = cssmin_resumable(ctx->cssmin);
+        }
+        else
+        {
+            same = jsmin_resumable(ctx->jsmin, seg->resume);
+        }
+
+        rc = seg->rc;
+
+        if (same && rc != NGX_DECLINED)
+        {
+            ctx->jsmin = seg->jsmin;
+            ctx->cssmin = seg->cssmin;
+        }
+        else
+        {
+            seg->in->buf->pos = seg->start;
+            seg->out->last = seg->out->pos;
+
+            rc = NGX_AGAIN;
+        }
+
+        if (rc == NGX_BUSY)
+        {
+            rc = NGX_AGAIN;
+        }
+
+        for (cl = seg->in; cl && rc == NGX_AGAIN; cl = cl->next)
+        {
+            b = cl->buf;
+            size = b->last - b->pos;
+
+            rc = ngx_http_minify_run_all(r, ctx, b, b->last_buf || b->last_in_chain, &seg->out);
+
+            redone += size - (b->last - b->pos);
+        }
+
+        if (rc != ((i == ctx->nsegments - 1) ? NGX_OK : NGX_AGAIN))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "minify of %O bytes failed", ctx->size);
+            return NGX_ERROR;
+        }
+
+        if (seg->out->last == seg->out->pos)
+        {
+            continue;
+        }
+
+        ctx->produced += seg->out->last - seg->out->pos;
+
+        if (ngx_http_minify_filter_link(r, ctx, seg->out) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* only what ran here held up the event loop */
+    ngx_http_minify_account(ngx_http_minify_usec() - usec, redone);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify thread done: %ui segments, %O bytes redone, %O bytes out",
+                   ctx->nsegments, redone, ctx->produced);
+
+    return ngx_http_minify_send_whole(r, ctx);
+}
+
+#endif
+
+/*
+ * 响应体都经过这里交给下一个过滤器。响应头被推迟时在第一次输出之前发出，
+ * 这时 content_length_n 已经是确切的长度，或者是 -1，按 chunked 发送。
+ * HEAD 请求发完响应头就结束。
+ */
+static ngx_int_t
+ngx_http_minify_output(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_int_t rc;
+    ngx_chain_t *cl;
+
+    if (ctx->delay_header)
+    {
+        ctx->delay_header = 0;
+
+        rc = ngx_http_next_header_filter(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (r->header_only)
+    {
+        for (cl = in; cl; cl = cl->next)
+        {
+            cl->buf->pos = cl->buf->last;
+            cl->buf->file_pos = cl->buf->file_last;
+        }
+
+        return NGX_OK;
+    }
+
+    return ngx_http_next_body_filter(r, in);
+}
+
+static ngx_uint_t
+ngx_http_minify_out_of_range(ngx_http_minify_conf_t *conf, off_t size)
+{
+    return size < conf->min_length || (conf->max_length && size > conf->max_length);
+}
+
+/*
+ * 负载保护：本秒内 worker 的 minify_cpu_budget 已用完，或者按观测到的吞吐量
+ * 估算这个响应会超过 minify_cpu_deadline，就不压缩，原样发送。
+ * 只在开始压缩之前判断，已经发出的压缩结果不会和原文混在一起。
+ */
+static ngx_uint_t
+ngx_http_minify_shed(ngx_http_request_t *r, off_t size)
+{
+    ngx_uint_t cost;
+    ngx_http_minify_cpu_t *cpu;
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (conf->cpu_budget == 0 && conf->cpu_deadline == 0)
+    {
+        return 0;
+    }
+
+    cpu = &ngx_http_minify_cpu;
+
+    if (cpu->sec != ngx_time())
+    {
+        cpu->sec = ngx_time();
+        cpu->used = 0;
+    }
+
+    /* in microseconds, 0 until the first response has been measured */
+    cost = (size > 0 && cpu->rate) ? (ngx_uint_t)(size * 1000 / cpu->rate) : 0;
+
+    if ((conf->cpu_budget && cpu->used + cost > conf->cpu_budget * 1000) || (conf->cpu_deadline && cost > conf->cpu_deadline * 1000))
+    {
+        cpu->shed++;
+
+        if (cpu->logged != cpu->sec)
+        {
+            cpu->logged = cpu->sec;
+
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "minify cpu budget exhausted, %ui responses shed",
+                          cpu->shed);
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+ngx_http_minify_account(ngx_uint_t usec, off_t size)
+{
+    ngx_uint_t rate;
+    ngx_http_minify_cpu_t *cpu;
+
+    cpu = &ngx_http_minify_cpu;
+
+    if (cpu->sec != ngx_time())
+    {
+        cpu->sec = ngx_time();
+        cpu->used = 0;
+    }
+
+    cpu->used += usec;
+
+    if (usec == 0 || size < 4096)
+    {
+        return;
+    }
+
+    rate = (ngx_uint_t)(size * 1000 / usec);
+
+    cpu->rate = cpu->rate ? (cpu->rate * 7 + rate) / 8 : rate;
+}
+
+static ngx_uint_t
+ngx_http_minify_usec(void)
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * 头部过滤器里决定跳过：URI 匹配 minify_skip_uri，或者之前已经判断过这个
+ * URI 已压缩过/压缩收益太小。跳过的响应保留 Content-Length。
+ */
+static ngx_uint_t
+ngx_http_minify_skip(ngx_http_request_t *r, ngx_http_minify_conf_t *conf)
+{
+    uint32_t hash;
+    ngx_http_minify_memo_t *memo;
+
+#if (NGX_PCRE)
+    if (conf->skip_uri && ngx_regex_exec_array(conf->skip_uri, &r->uri, r->connection->log) == NGX_OK)
+    {
+        return 1;
+    }
+#endif
+
+    if (!conf->sniff)
+    {
+        return 0;
+    }
+
+    hash = ngx_crc32_short(r->uri.data, r->uri.len);
+    memo = &ngx_http_minify_memo[hash % NGX_HTTP_MINIFY_MEMO_SIZE];
+
+    return memo->hash == hash && memo->mtime == r->headers_out.last_modified_time && memo->length == r->headers_out.content_length_n && memo->ratio >= NGX_HTTP_MINIFY_SKIP_RATIO;
+}
+
+/*
+ * 看响应体开头的一段：几乎没有连续空白、行很长、没有注释，就认为已经压缩过。
+ * "//" 也会出现在字符串里的 URL 中，只会让判断更保守。
+ */
+static ngx_uint_t
+ngx_http_minify_sniff(ngx_chain_t *in)
+{
+    u_char *p, *last;
+    size_t size;
+    ngx_buf_t *b;
+    ngx_uint_t lines, blank, comments;
+
+    if (in == NULL)
+    {
+        return 0;
+    }
+
+    b = in->buf;
+
+    if (!ngx_buf_in_memory(b))
+    {
+        return 0;
+    }
+
+    size = ngx_min((size_t)(b->last - b->pos), NGX_HTTP_MINIFY_SNIFF_SIZE);
+
+    if (size < NGX_HTTP_MINIFY_SNIFF_MIN)
+    {
+        return 0;
+    }
+
+    lines = 1;
+    blank = 0;
+    comments = 0;
+    last = b->pos + size;
+
+    for (p = b->pos + 1; p < last; p++)
+    {
+        switch (*p)
+        {
+
+        case '\n':
+            lines++;
+
+            /* fall through */
+
+        case ' ':
+        case '\t':
+        case '\r':
+            if (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\n' || p[-1] == '\r')
+            {
+                blank++;
+            }
+            break;
+
+        case '*':
+        case '/':
+            if (p[-1] == '/')
+            {
+                comments++;
+            }
+            break;
+        }
+    }
+
+    /* a leading license comment is kept by most minifiers */
+
+    return size / lines >= 200 && blank * 100 < size && comments <= 1 + size / 1024;
+}
+
+static void
+ngx_http_minify_remember(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_uint_t ratio)
+{
+    uint32_t hash;
+    ngx_http_minify_memo_t *memo;
+
+    if (ctx->length == -1 && r->headers_out.last_modified_time == -1)
+    {
+        /* nothing to tell a changed response by */
+        return;
+    }
+
+    hash = ngx_crc32_short(r->uri.data, r->uri.len);
+    memo = &ngx_http_minify_memo[hash % NGX_HTTP_MINIFY_MEMO_SIZE];
+
+    memo->hash = hash;
+    memo->mtime = r->headers_out.last_modified_time;
+    memo->length = ctx->length;
+    memo->ratio = ratio;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify remember \"%V\" ratio %ui%%", &r->uri, ratio);
+}
+
+/*
+ * 把已收集的块写入临时文件并释放，之后 ctx->in 只挂一个窗口缓冲，
+ * 每次写满就写入文件再复用。
+ */
+static ngx_int_t
+ngx_http_minify_spill(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_buf_t *w;
+    ngx_chain_t *cl;
+    ngx_temp_file_t *tf;
+    ngx_http_minify_conf_t *conf;
+
+    tf = ctx->temp_file;
+
+    if (tf == NULL)
+    {
+        conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = conf->temp_path;
+        tf->pool = r->pool;
+        tf->warn = "a response body to minify is buffered to a temporary file";
+        tf->log_level = NGX_LOG_WARN;
+
+        ctx->temp_file = tf;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http minify spill after %O bytes", ctx->size);
+    }
+
+    if (ctx->in && ngx_write_chain_to_temp_file(tf, ctx->in) == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    w = ctx->window;
+
+    for (cl = ctx->in; cl; cl = cl->next)
+    {
+        if (cl->buf != w)
+        {
+            ngx_pfree(r->pool, cl->buf->start);
+        }
+    }
+
+    if (w == NULL)
+    {
+        w = ngx_create_temp_buf(r->pool, NGX_HTTP_MINIFY_GATHER_SIZE);
+        if (w == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = w;
+        cl->next = NULL;
+
+        ctx->in = cl;
+        ctx->last_in = &cl->next;
+        ctx->window = w;
+    }
+
+    w->pos = w->start;
+    w->last = w->start;
+
+    ctx->gather = w;
+
+    return NGX_OK;
+}
+
+/*
+ * 可写的内存缓冲（temporary 且不在文件中，例如 proxy/fastcgi 的缓冲和收集缓冲）直接原地压缩：
+ * 输出跟在读指针后面写回同一块内存，压缩完后把这个缓冲本身交给下游，
+ * 上游在它发送完之前不会复用。输出追上读指针时（极少见），已写的部分拷贝出来
+ * 发送，剩下的转入普通输出缓冲。
+ * 普通输出缓冲最多 minify_buffers 个，全部在下游未发送时暂停，剩余输入留在
+ * ctx 里，等下游把缓冲发送出去后再次调用时继续，和 gzip 过滤器一样。
+ */
+static ngx_int_t
+ngx_http_minify_filter_run(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in)
+{
+    u_char *pos, *last;
+    ngx_int_t rc;
+    ngx_buf_t *b, *out;
+    ngx_uint_t usec;
+    ngx_http_minify_conf_t *conf;
+
+    if (in && ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->nomem)
+    {
+        /* flush busy buffers */
+
+        if (ngx_http_minify_output(r, ctx, NULL) == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                                (ngx_buf_tag_t)&ngx_http_minify_filter_module);
+        ctx->last_out = &ctx->out;
+
+        ctx->nomem = 0;
+    }
+
+    while (!ctx->done)
+    {
+        if (ctx->in_buf == NULL && ctx->file_buf == NULL)
+        {
+            if (ctx->in == NULL)
+            {
+                break;
+            }
+
+            b = ctx->in->buf;
+            ctx->in = ctx->in->next;
+
+            if (!ngx_buf_in_memory(b) && b->in_file)
+            {
+                ctx->file_buf = b;
+            }
+            else
+            {
+                ctx->in_buf = b;
+
+                if (b->temporary && !b->in_file && b->pos < b->last)
+                {
+                    out = &ctx->in_place_buf;
+
+                    out->start = b->pos;
+                    out->pos = b->pos;
+                    out->last = b->pos;
+                    out->end = b->last;
+
+                    ctx->in_place = 1;
+                }
+            }
+        }
+
+        if (ctx->in_buf == NULL)
+        {
+            rc = ngx_http_minify_read_file(r, ctx);
+
+            if (rc == NGX_AGAIN)
+            {
+                /* what is minified so far goes out meanwhile */
+                break;
+            }
+
+            if (rc != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ctx->in_place)
+        {
+            out = &ctx->in_place_buf;
+        }
+        else
+        {
+            if (ctx->out_buf == NULL)
+            {
+                rc = ngx_http_minify_filter_get_buf(r, ctx);
+
+                if (rc == NGX_DECLINED)
+                {
+                    break;
+                }
+
+                if (rc == NGX_ERROR)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            out = ctx->out_buf;
+        }
+
+        b = ctx->in_buf;
+
+        pos = b->pos;
+        last = out->last;
+        usec = ngx_http_minify_usec();
+
+        rc = ngx_http_minify_engine_run(ctx, b, out, b->last_buf || b->last_in_chain);
+
+        ngx_http_minify_account(ngx_http_minify_usec() - usec, b->pos - pos);
+
+        ctx->consumed += b->pos - pos;
+        ctx->produced += out->last - last;
+
+        if (rc == NGX_BUSY && ctx->in_place)
+        {
+            /*
+             * the output caught up with the read cursor: the rest goes to
+             * regular buffers, and what is already in place is copied out,
+             * as the input buffer is given back once it is consumed
+             */
+
+            if (out->last != out->start)
+            {
+                b = ngx_create_temp_buf(r->pool, out->last - out->start);
+                if (b == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                b->last = ngx_cpymem(b->pos, out->start, out->last - out->start);
+
+                if (ngx_http_minify_filter_link(r, ctx, b) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            ctx->in_place = 0;
+
+            continue;
+        }
+
+        if (rc == NGX_BUSY)
+        {
+            /* the output buffer is full, pass it on and resume */
+
+            if (ngx_http_minify_filter_out(r, ctx) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (rc != NGX_OK && rc != NGX_AGAIN)
+        {
+            return NGX_ERROR;
+        }
+
+        /* the input buffer is consumed, push out what it produced */
+
+        ctx->flush = b->flush;
+        ctx->sync = b->sync;
+
+        if (rc == NGX_OK)
+        {
+            ctx->last_buf = b->last_buf;
+            ctx->last_in_chain = b->last_in_chain;
+            ctx->done = 1;
+
+            conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+            if (conf->sniff && ctx->consumed)
+            {
+                ngx_http_minify_remember(r, ctx, (ngx_uint_t)(ctx->produced * 100 / ctx->consumed));
+            }
+        }
+
+        if (ctx->in_place)
+        {
+            /* the flags go out with the last output buffer instead */
+
+            out = &ctx->in_place_buf;
+
+            if (out->last != out->start && ngx_http_minify_filter_link(r, ctx, b) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            b->pos = out->start;
+            b->last = out->last;
+            b->flush = 0;
+            b->sync = 0;
+            b->last_buf = 0;
+            b->last_in_chain = 0;
+
+            ctx->in_place = 0;
+        }
+
+        ctx->in_buf = NULL;
+
+        if (ngx_http_minify_filter_out(r, ctx) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->cache_fill && ngx_http_minify_cache_collect(r, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->cache_stale)
+    {
+        return ngx_http_minify_cache_discard(r, ctx);
+    }
+
+    if (ctx->out == NULL)
+    {
+        return (ctx->busy || ctx->reading) ? NGX_AGAIN : NGX_OK;
+    }
+
+    rc = ngx_http_minify_output(r, ctx, ctx->out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                            (ngx_buf_tag_t)&ngx_http_minify_filter_module);
+    ctx->last_out = &ctx->out;
+
+    return rc;
+}
+
+/*
+ * 从 in_file 缓冲读下一个窗口。窗口是自己的缓冲，每次读之前都已被引擎读完，
+ * 所以不做原地压缩；最后一个窗口带上文件缓冲的 last_buf 等标志。
+ * 读挂起时返回 NGX_AGAIN，读完后再次调用时取回结果。
+ */
+static ngx_int_t
+ngx_http_minify_read_file(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+    ngx_buf_t *b, *w;
+
+    if (ctx->reading)
+    {
+        return NGX_AGAIN;
+    }
+
+    b = ctx->file_buf;
+    w = ctx->window;
+
+    if (w == NULL)
+    {
+        w = ngx_create_temp_buf(r->pool, NGX_HTTP_MINIFY_GATHER_SIZE);
+        if (w == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->window = w;
+    }
+
+    w->pos = w->start;
+    w->last = w->start;
+
+    rc = ngx_http_minify_read(r, ctx, b, w);
+
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
+
+    if (b->file_pos == b->file_last)
+    {
+        w->flush = b->flush;
+        w->sync = b->sync;
+        w->last_buf = b->last_buf;
+        w->last_in_chain = b->last_in_chain;
+
+        ctx->file_buf = NULL;
+    }
+    else
+    {
+        w->flush = 0;
+        w->sync = 0;
+        w->last_buf = 0;
+        w->last_in_chain = 0;
+    }
+
+    ctx->in_buf = w;
+
+    return NGX_OK;
+}
+
+/*
+ * 从 src 的文件里读到 dst 的空闲部分，读完推进 src->file_pos 和 dst->last。
+ * location 配置了 aio threads 时在线程池里读，aio on 时用文件 AIO，不挡住
+ * 事件循环：请求挂起，读完投递写事件，过滤器再次被调用时用同样的参数
+ * 再调一次取回结果。没有配置 aio 时同步读。
+ */
+static ngx_int_t
+ngx_http_minify_read(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx,
+                     ngx_buf_t *src, ngx_buf_t *dst)
+{
+    off_t size;
+    ssize_t n;
+    ngx_file_t *file;
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ngx_http_core_loc_conf_t *clcf;
+#endif
+#if (NGX_THREADS)
+    void *thread_ctx;
+    ngx_int_t (*thread_handler)(ngx_thread_task_t *task, ngx_file_t *file);
+#endif
+
+    file = src->file;
+    size = ngx_min(src->file_last - src->file_pos, dst->end - dst->last);
+
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+    if (ngx_file_aio && clcf->aio == NGX_HTTP_AIO_ON)
+    {
+        n = ngx_file_aio_read(file, dst->last, (size_t)size, src->file_pos, r->pool);
+
+        if (n == NGX_AGAIN)
+        {
+            file->aio->data = r;
+            file->aio->handler = ngx_http_minify_read_aio_handler;
+        }
+    }
+    else
+#endif
+#if (NGX_THREADS)
+    if (clcf->aio == NGX_HTTP_AIO_THREADS)
+    {
+        /* the writer may send this file later with handlers of its own */
+
+        thread_handler = file->thread_handler;
+        thread_ctx = file->thread_ctx;
+
+        file->thread_handler = ngx_http_minify_read_thread_handler;
+        file->thread_ctx = r;
+
+        n = ngx_thread_read(file, dst->last, (size_t)size, src->file_pos, r->pool);
+
+        file->thread_handler = thread_handler;
+        file->thread_ctx = thread_ctx;
+    }
+    else
+#endif
+    {
+        n = ngx_read_file(file, dst->last, (size_t)size, src->file_pos);
+    }
+
+    if (n == NGX_AGAIN)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http minify read %O bytes at %O", size, src->file_pos);
+
+        ctx->reading = 1;
+        r->main->blocked++;
+        r->connection->buffered |= NGX_HTTP_MINIFY_BUFFERED;
+
+        return NGX_AGAIN;
+    }
+
+    if (n == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    if (n != size)
+    {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %O from \"%s\"",
+                      n, size, file->name.data);
+        return NGX_ERROR;
+    }
+
+    src->file_pos += n;
+    dst->last += n;
+
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_minify_read_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t name;
+    ngx_thread_pool_t *tp;
+    ngx_http_request_t *r;
+    ngx_http_core_loc_conf_t *clcf;
+
+    r = file->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL)
+    {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *)ngx_cycle, &name);
+
+        if (tp == NULL)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_minify_read_event_handler;
+
+    return ngx_thread_task_post(tp, task);
+}
+
+static void
+ngx_http_minify_read_event_handler(ngx_event_t *ev)
+{
+    ngx_http_minify_read_done(ev->data);
+}
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_minify_read_aio_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t *aio = ev->data;
+
+    ngx_http_minify_read_done(aio->data);
+}
+
+#endif
+
+static void
+ngx_http_minify_read_done(ngx_http_request_t *r)
+{
+    ngx_http_minify_filter_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
+
+    ctx->reading = 0;
+
+    r->main->blocked--;
+    r->connection->buffered &= ~NGX_HTTP_MINIFY_BUFFERED;
+
+    /* the writer calls the filter chain again, which collects the result */
+
+    ngx_post_event(r->connection->write, &ngx_posted_events);
+}
+
+/*
+ * 压缩结果的 ETag：原来的 ETag（没有时用 Last-Modified 和长度）加上类型和
+ * NGX_HTTP_MINIFY_VERSION 的 md5，不用等压缩完，各台服务器上也一样。原来
+ * 是弱 ETag 的结果也是弱的；什么都没有就不发 ETag。If-None-Match 命中时
+ * 把响应改成 304，返回 NGX_DONE。
+ */
+static ngx_int_t
+ngx_http_minify_etag(ngx_http_request_t *r, ngx_uint_t type)
+{
+    u_char *p;
+    ngx_uint_t weak;
+    ngx_md5_t md5;
+    ngx_table_elt_t *etag;
+    u_char hash[16];
+    u_char validator[NGX_TIME_T_LEN + NGX_OFF_T_LEN + 2];
+
+    etag = r->headers_out.etag;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, NGX_HTTP_MINIFY_VERSION, sizeof(NGX_HTTP_MINIFY_VERSION) - 1);
+    ngx_md5_update(&md5, (type == NGX_HTTP_MINIFY_CSS) ? "css" : "js",
+                   (type == NGX_HTTP_MINIFY_CSS) ? 3 : 2);
+
+    if (etag && etag->hash && etag->value.len)
+    {
+        weak = (etag->value.len > 2 && etag->value.data[0] == 'W' && etag->value.data[1] == '/');
+
+        ngx_md5_update(&md5, etag->value.data, etag->value.len);
+    }
+    else if (r->headers_out.last_modified_time != -1 && r->headers_out.content_length_n != -1)
+    {
+        weak = 0;
+
+        p = ngx_sprintf(validator, "%xT-%xO", r->headers_out.last_modified_time,
+                        r->headers_out.content_length_n);
+
+        ngx_md5_update(&md5, validator, p - validator);
+    }
+    else
+    {
+        /* the one there is for the original bytes */
+
+        ngx_http_clear_etag(r);
+        return NGX_OK;
+    }
+
+    ngx_md5_final(hash, &md5);
+
+    if (etag == NULL || etag->hash == 0)
+    {
+        etag = ngx_list_push(&r->headers_out.headers);
+        if (etag == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        etag->hash = 1;
+#if (nginx_version >= 1023000)
+        etag->next = NULL;
+#endif
+        ngx_str_set(&etag->key, "ETag");
+
+        r->headers_out.etag = etag;
+    }
+
+    etag->value.data = ngx_pnalloc(r->pool, sizeof("W/\"\"") - 1 + 2 * sizeof(hash));
+    if (etag->value.data == NULL)
+    {
+        etag->hash = 0;
+        r->headers_out.etag = NULL;
+        return NGX_ERROR;
+    }
+
+    p = etag->value.data;
+
+    if (weak)
+    {
+        *p++ = 'W';
+        *p++ = '/';
+    }
+
+    *p++ = '"';
+    p = ngx_hex_dump(p, hash, sizeof(hash));
+    *p++ = '"';
+
+    etag->value.len = p - etag->value.data;
+
+    if (r->headers_in.if_none_match == NULL || r != r->main || r->disable_not_modified || !ngx_http_minify_etag_match(r->headers_in.if_none_match, &etag->value))
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify not modified, etag %V", &etag->value);
+
+    /* as ngx_http_not_modified_filter_module does */
+
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_type.len = 0;
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+
+    return NGX_DONE;
+}
+
+/*
+ * If-None-Match 用弱比较："*"，或者列表里有一个去掉 W/ 后和 etag 相同。
+ */
+static ngx_uint_t
+ngx_http_minify_etag_match(ngx_table_elt_t *header, ngx_str_t *etag)
+{
+    u_char *p, *end, *start, *tag;
+    size_t len;
+
+    tag = etag->data;
+    len = etag->len;
+
+    if (len > 2 && tag[0] == 'W' && tag[1] == '/')
+    {
+        tag += 2;
+        len -= 2;
+    }
+
+    p = header->value.data;
+    end = p + header->value.len;
+
+    if (header->value.len == 1 && *p == '*')
+    {
+        return 1;
+    }
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            p++;
+        }
+
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+        {
+            p += 2;
+        }
+
+        start = p;
+
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+
+        while (p > start && (p[-1] == ' ' || p[-1] == '\t'))
+        {
+            p--;
+        }
+
+        if ((size_t)(p - start) == len && ngx_strncmp(start, tag, len) == 0)
+        {
+            return 1;
+        }
+
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * minify_cache_zone 的 key：静态文件用映射到的文件路径加 inode、修改时间和
+ * 大小（通过 open_file_cache 取得，没有配置时只做一次 stat），代理等其他
+ * 内容只有配置了 minify_cache_key 才缓存，用它加上游的长度和修改时间。
+ * 去掉版本部分就是条目的名字，用来找旧版本；用路径而不是 URI，共用一个
+ * zone 的虚拟主机和 location 不会拿到彼此的旧版本。
+ */
+static ngx_int_t
+ngx_http_minify_cache_key(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    u_char *last;
+    size_t root;
+    ngx_int_t rc;
+    ngx_md5_t md5, name;
+    ngx_str_t path, value;
+    ngx_open_file_info_t of;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_core_loc_conf_t *clcf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, &ctx->type, sizeof(ngx_uint_t));
+
+    if (conf->cache_key)
+    {
+        if (ngx_http_complex_value(r, conf->cache_key, &value) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        name = md5;
+        ngx_md5_update(&name, value.data, value.len);
+        ngx_md5_final(ctx->cache_name, &name);
+
+        ngx_md5_update(&md5, value.data, value.len);
+        ngx_md5_update(&md5, &r->headers_out.content_length_n, sizeof(off_t));
+        ngx_md5_update(&md5, &r->headers_out.last_modified_time, sizeof(time_t));
+        ngx_md5_final(ctx->cache_key, &md5);
+
+        return NGX_OK;
+    }
+
+    if (r->upstream)
+    {
+        return NGX_DECLINED;
+    }
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    path.len = last - path.data;
+
+    ngx_md5_update(&md5, path.data, path.len);
+
+    name = md5;
+    ngx_md5_final(ctx->cache_name, &name);
+
+    if (conf->cache_watched)
+    {
+        /* taken before the stat, so a change after it is not missed */
+
+        ctx->cache_path_hash = ngx_http_minify_cache_path_hash(path.data, path.len);
+        ctx->cache_generation = ngx_http_minify_cache_generation(conf->cache_zone,
+                                                                 ctx->cache_path_hash);
+
+        rc = NGX_DECLINED;
+
+        if (conf->worker_cache)
+        {
+            rc = ngx_http_minify_worker_cache_lookup_watched(conf->cache_zone, ctx->cache_name,
+                                                             ctx->cache_path_hash, r->pool,
+                                                             &ctx->cached, ctx->cache_key);
+        }
+
+        if (rc == NGX_DECLINED)
+        {
+            rc = ngx_http_minify_cache_lookup_watched(conf->cache_zone, ctx->cache_name,
+                                                      ctx->cache_path_hash, r->pool,
+                                                      &ctx->cached, ctx->cache_key);
+
+            if (rc == NGX_OK && conf->worker_cache)
+            {
+                ngx_http_minify_worker_cache_store(conf->worker_cache, ctx->cache_key,
+                                                   ctx->cache_name, conf->cache_zone,
+                                                   ctx->cache_path_hash, ctx->cache_generation,
+                                                   ctx->cached.data, ctx->cached.len,
+                                                   r->connection->log);
+            }
+        }
+
+        if (rc != NGX_DECLINED)
+        {
+            return (rc == NGX_OK) ? NGX_DONE : NGX_ERROR;
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.test_only = 1;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK || !of.is_file)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_md5_update(&md5, &of.uniq, sizeof(ngx_file_uniq_t));
+    ngx_md5_update(&md5, &of.mtime, sizeof(time_t));
+    ngx_md5_update(&md5, &of.size, sizeof(off_t));
+    ngx_md5_final(ctx->cache_key, &md5);
+
+    return NGX_OK;
+}
+
+/*
+ * 依次查进程内缓存、共享内存和文件缓存，共享内存命中时顺便放进进程内缓存。
+ * minify_cache_watch 的命中在 ngx_http_minify_cache_key 里就按同样的顺序查过了。
+ * 文件缓存命中时不读进内存，cached.len 只是文件大小。
+ */
+static ngx_int_t
+ngx_http_minify_cache_find(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    rc = NGX_DECLINED;
+
+    if (conf->worker_cache)
+    {
+        rc = ngx_http_minify_worker_cache_lookup(ctx->cache_key, r->pool, &ctx->cached);
+    }
+
+    if (rc == NGX_DECLINED && conf->cache_zone)
+    {
+        rc = ngx_http_minify_cache_lookup(conf->cache_zone, ctx->cache_key,
+                                          r->pool, &ctx->cached);
+
+        if (rc == NGX_OK && conf->worker_cache)
+        {
+            ngx_http_minify_worker_cache_store(conf->worker_cache, ctx->cache_key,
+                                               ctx->cache_name,
+                                               conf->cache_watched ? conf->cache_zone : NULL,
+                                               ctx->cache_path_hash, ctx->cache_generation,
+                                               ctx->cached.data, ctx->cached.len,
+                                               r->connection->log);
+        }
+    }
+
+    if (rc == NGX_DECLINED && conf->cache_file)
+    {
+        rc = ngx_http_minify_file_cache_open(r, conf->cache_file, ctx->cache_key,
+                                             &ctx->cache_file_buf);
+
+        if (rc == NGX_OK)
+        {
+            ctx->cached.data = NULL;
+            ctx->cached.len = ctx->cache_file_buf->file_last;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * minify_cache_content：body 收齐后用它的 hash 作 key 查缓存，命中就丢掉
+ * body 发缓存的内容，否则压缩后以这个 key 存入。
+ */
+static ngx_int_t
+ngx_http_minify_cache_content(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+
+    ngx_http_minify_cache_hash_final(ctx->cache_key, &ctx->hash);
+    ngx_memcpy(ctx->cache_name, ctx->cache_key, NGX_HTTP_MINIFY_CACHE_KEY_LEN);
+
+    rc = ngx_http_minify_cache_find(r, ctx);
+
+    if (rc != NGX_OK)
+    {
+        ctx->cache_fill = (rc == NGX_DECLINED);
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http minify same body as before, %O bytes", ctx->size);
+
+    ctx->cache_hit = 1;
+    ctx->status = NGX_HTTP_MINIFY_HIT;
+
+    return ngx_http_minify_cache_send(r, ctx, ctx->in);
+}
+
+/*
+ * 命中：输入直接丢弃，第一次调用就发出缓存的内容，last_buf 等到输入结束时
+ * 再单独发。
+ */
+static ngx_int_t
+ngx_http_minify_cache_send(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_chain_t *in)
+{
+    ssize_t n;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+
+    for (/* void */; in; in = in->next)
+    {
+        b = in->buf;
+
+        if (b->last_buf || b->last_in_chain)
+        {
+            ctx->last_buf = b->last_buf;
+            ctx->last_in_chain = b->last_in_chain;
+            ctx->done = 1;
+        }
+
+        b->pos = b->last;
+        b->file_pos = b->file_last;
+    }
+
+    if (ctx->delay_header)
+    {
+        r->headers_out.content_length_n = ctx->cached.len;
+    }
+
+    if ((ctx->cache_sent || ctx->cached.len == 0) && !ctx->done)
+    {
+        return ngx_http_minify_output(r, ctx, NULL);
+    }
+
+    if (!ctx->cache_sent && ctx->cache_file_buf
+        && (r->filter_need_in_memory || r->main_filter_need_in_memory))
+    {
+        /* a filter after us, gzip for one, cannot read files */
+
+        ctx->cached.data = ngx_pnalloc(r->pool, ctx->cached.len);
+        if (ctx->cached.data == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        n = ngx_read_file(ctx->cache_file_buf->file, ctx->cached.data, ctx->cached.len, 0);
+
+        if (n != (ssize_t)ctx->cached.len)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "minify cache file \"%V\" read %z of %uz bytes",
+                          &ctx->cache_file_buf->file->name, n, ctx->cached.len);
+            return NGX_ERROR;
+        }
+
+        ctx->cache_file_buf = NULL;
+    }
+
+    if (!ctx->cache_sent && ctx->cache_file_buf)
+    {
+        b = ctx->cache_file_buf;
+
+        ctx->cache_sent = 1;
+    }
+    else
+    {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (!ctx->cache_sent && ctx->cached.len)
+        {
+            b->start = ctx->cached.data;
+            b->pos = b->start;
+            b->last = b->start + ctx->cached.len;
+            b->end = b->last;
+            b->memory = 1;
+
+            ctx->cache_sent = 1;
+        }
+    }
+
+    b->last_buf = ctx->last_buf;
+    b->last_in_chain = ctx->last_in_chain;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_minify_output(r, ctx, &out);
+}
+
+/*
+ * 未命中：把要发出的输出另外拷贝一份，压缩完成后存入共享内存、进程内缓存
+ * 和文件缓存。超过缓存一半大小的结果不缓存，有文件缓存时上限是
+ * minify_max_buffer_size。
+ */
+static ngx_int_t
+ngx_http_minify_cache_collect(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    size_t size, n, max;
+    ngx_buf_t *b, *c;
+    ngx_chain_t *cl;
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    max = ngx_max(conf->cache_zone ? conf->cache_zone->shm.size : 0, conf->worker_cache) / 2;
+
+    if (conf->cache_file)
+    {
+        max = ngx_max(max, conf->max_buffer_size);
+    }
+
+    for (cl = ctx->out; cl; cl = cl->next)
+    {
+        b = cl->buf;
+        size = ngx_buf_in_memory(b) ? (size_t)(b->last - b->pos) : 0;
+
+        if (size == 0)
+        {
+            continue;
+        }
+
+        c = ctx->cache_buf;
+
+        if (c == NULL || (size_t)(c->end - c->last) < size)
+        {
+            n = c ? (size_t)(c->last - c->start) : 0;
+            n = ngx_max(ngx_max(n * 2, n + size), (size_t)ngx_max(ctx->length, ctx->size));
+
+            if (n > max)
+            {
+                ctx->cache_fill = 0;
+                return NGX_OK;
+            }
+
+            b = ngx_create_temp_buf(r->pool, n);
+            if (b == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            if (c)
+            {
+                b->last = ngx_cpymem(b->pos, c->pos, c->last - c->pos);
+                ngx_pfree(r->pool, c->start);
+            }
+
+            ctx->cache_buf = b;
+            c = b;
+            b = cl->buf;
+        }
+
+        c->last = ngx_cpymem(c->last, b->pos, size);
+    }
+
+    if (ctx->done)
+    {
+        c = ctx->cache_buf;
+
+        if (c && conf->cache_zone)
+        {
+            (void)ngx_http_minify_cache_store(conf->cache_zone, ctx->cache_key, ctx->cache_name,
+                                              ctx->cache_path_hash, ctx->cache_generation,
+                                              c->pos, c->last - c->pos,
+                                              conf->cache_min_uses, r->connection->log);
+        }
+
+        if (c && conf->worker_cache)
+        {
+            ngx_http_minify_worker_cache_store(conf->worker_cache, ctx->cache_key,
+                                               ctx->cache_name,
+                                               conf->cache_watched ? conf->cache_zone : NULL,
+                                               ctx->cache_path_hash, ctx->cache_generation,
+                                               c->pos, c->last - c->pos,
+                                               r->connection->log);
+        }
+
+        if (c && conf->cache_file)
+        {
+            (void)ngx_http_minify_file_cache_store(conf->cache_file, ctx->cache_key,
+                                                   c->pos, c->last - c->pos,
+                                                   r->pool, r->connection->log);
+        }
+
+        if (c)
+        {
+            ngx_pfree(r->pool, c->start);
+        }
+
+        ctx->cache_fill = 0;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * minify_cache_use_stale updating：输出只进缓存，不发给客户端，输出缓冲
+ * 直接回收；结束时补发带 last_buf 的空缓冲。
+ */
+static ngx_int_t
+ngx_http_minify_cache_discard(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_buf_t *b;
+    ngx_chain_t *cl, out;
+
+    b = NULL;
+
+    for (cl = ctx->out; cl; cl = cl->next)
+    {
+        cl->buf->pos = cl->buf->last;
+
+        if (cl->buf->last_buf || cl->buf->last_in_chain)
+        {
+            b = cl->buf;
+        }
+    }
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                            (ngx_buf_tag_t)&ngx_http_minify_filter_module);
+    ctx->last_out = &ctx->out;
+
+    if (b == NULL)
+    {
+        return NGX_OK;
+    }
+
+    out.buf = ngx_calloc_buf(r->pool);
+    if (out.buf == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    out.buf->last_buf = b->last_buf;
+    out.buf->last_in_chain = b->last_in_chain;
+    out.next = NULL;
+
+    return ngx_http_minify_output(r, ctx, &out);
+}
+
+/*
+ * 等待别的请求填充缓存：body 已经收齐，锁还在就定时再看，期间设置
+ * c->buffered，nginx 会在写事件里再次调用过滤器；锁释放或超时后查一次
+ * 缓存，命中就发缓存，否则自己压缩。
+ */
+static ngx_int_t
+ngx_http_minify_cache_wait(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_int_t rc;
+    ngx_connection_t *c;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_minify_conf_t *conf;
+
+    c = r->connection;
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if ((ngx_msec_int_t)(ctx->wait_until - ngx_current_msec) > 0 && ngx_http_minify_cache_locked(conf->cache_zone, ctx->cache_key))
+    {
+        if (ctx->wait.handler == NULL)
+        {
+            cln = ngx_pool_cleanup_add(r->pool, 0);
+            if (cln == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            cln->handler = ngx_http_minify_cache_wait_cleanup;
+            cln->data = &ctx->wait;
+
+            ctx->wait.handler = ngx_http_minify_cache_wait_handler;
+            ctx->wait.data = r;
+            ctx->wait.log = c->log;
+            ctx->wait.cancelable = 1;
+        }
+
+        if (!ctx->wait.timer_set)
+        {
+            ngx_add_timer(&ctx->wait, NGX_HTTP_MINIFY_LOCK_POLL);
+        }
+
+        c->buffered |= NGX_HTTP_MINIFY_BUFFERED;
+
+        return NGX_AGAIN;
+    }
+
+    ctx->cache_wait = 0;
+    c->buffered &= ~NGX_HTTP_MINIFY_BUFFERED;
+
+    rc = ngx_http_minify_cache_lookup(conf->cache_zone, ctx->cache_key, r->pool, &ctx->cached);
+
+    if (rc != NGX_OK)
+    {
+        return (rc == NGX_ERROR) ? NGX_ERROR : NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http minify filled by another request");
+
+    ctx->cache_hit = 1;
+    ctx->cache_fill = 0;
+    ctx->status = NGX_HTTP_MINIFY_HIT;
+
+    return ngx_http_minify_cache_send(r, ctx, ctx->in);
+}
+
+static void
+ngx_http_minify_cache_wait_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t *r = ev->data;
+
+    /* the writer calls the filter chain again */
+
+    ngx_post_event(r->connection->write, &ngx_posted_events);
+}
+
+static void
+ngx_http_minify_cache_wait_cleanup(void *data)
+{
+    ngx_event_t *ev = data;
+
+    if (ev->timer_set)
+    {
+        ngx_del_timer(ev);
+    }
+}
+
+static ngx_int_t
+ngx_http_minify_filter_get_buf(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_http_minify_conf_t *conf;
+
+    if (ctx->free)
+    {
+        ctx->out_buf = ctx->free->buf;
+        ctx->free = ctx->free->next;
+
+        ctx->out_buf->flush = 0;
+        ctx->out_buf->sync = 0;
+
+        return NGX_OK;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (ctx->bufs >= conf->bufs.num)
+    {
+        /* all buffers are still on their way to the client */
+
+        ctx->nomem = 1;
+        return NGX_DECLINED;
+    }
+
+    ctx->out_buf = ngx_create_temp_buf(r->pool, conf->bufs.size);
+    if (ctx->out_buf == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->out_buf->tag = (ngx_buf_tag_t)&ngx_http_minify_filter_module;
+    ctx->out_buf->recycled = 1;
+    ctx->bufs++;
+
+    return NGX_OK;
+}
+
+/*
+ * 把当前输出缓冲挂到 ctx->out 上。空缓冲只在需要传递 flush/sync/last_buf
+ * 时才发送，并且换成一个不占内存的特殊缓冲。
+ */
+static ngx_int_t
+ngx_http_minify_filter_out(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_buf_t *b;
+
+    b = ctx->out_buf;
+
+    if (b == NULL || b->last == b->pos)
+    {
+        if (!ctx->flush && !ctx->sync && !ctx->done)
+        {
+            return NGX_OK;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+    else
+    {
+        ctx->out_buf = NULL;
+    }
+
+    b->flush = ctx->flush;
+    b->sync = ctx->sync;
+    ctx->flush = 0;
+    ctx->sync = 0;
+
+    if (ctx->done)
+    {
+        b->last_buf = ctx->last_buf;
+        b->last_in_chain = ctx->last_in_chain;
+    }
+
+    return ngx_http_minify_filter_link(r, ctx, b);
+}
+
+static ngx_int_t
+ngx_http_minify_filter_link(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx, ngx_buf_t *b)
+{
+    ngx_chain_t *cl;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    return NGX_OK;
+}
+
+static ngx_uint_t
+ngx_http_minify_engine_type(ngx_http_request_t *r)
+{
+    ngx_str_t *type;
+
+    type = &r->headers_out.content_type;
+
+    if (ngx_strlcasestrn(type->data, type->data + type->len, (u_char *)"javascript", 10 - 1) != NULL)
+    {
+        return NGX_HTTP_MINIFY_JS;
+    }
+
+    if (ngx_strlcasestrn(type->data, type->data + type->len, (u_char *)"css", 3 - 1) != NULL)
+    {
+        return NGX_HTTP_MINIFY_CSS;
+    }
+
+    return 0;
+}
+
+static ngx_int_t
+ngx_http_minify_engine_run(ngx_http_minify_filter_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out, ngx_uint_t last)
+{
+    if (ctx->type == NGX_HTTP_MINIFY_CSS)
+    {
+        ctx->cssmin->last = last;
+        ctx->cssmin->in_place = ctx->in_place;
+        return cssmin(ctx->cssmin, in, out);
+    }
+
+    ctx->jsmin->last = last;
+    ctx->jsmin->in_place = ctx->in_place;
+    return jsmin(ctx->jsmin, in, out);
+}
+
+/*
+ * 把 in 剩下的部分压缩进 *out，*out 为空时先分配一个，放不下就换成两倍大的。
+ */
+static ngx_int_t
+ngx_http_minify_run_all(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx,
+                        ngx_buf_t *in, ngx_uint_t last, ngx_buf_t **out)
+{
+    size_t size;
+    ngx_int_t rc;
+    ngx_buf_t *b, *nb;
+
+    b = *out;
+
+    if (b == NULL)
+    {
+        b = ngx_create_temp_buf(r->pool, ngx_max((size_t)(in->last - in->pos), 64));
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    for (;;)
+    {
+        rc = ngx_http_minify_engine_run(ctx, in, b, last);
+
+        if (rc != NGX_BUSY)
+        {
+            break;
+        }
+
+        size = 2 * (size_t)(b->end - b->start);
+
+        nb = ngx_create_temp_buf(r->pool, size);
+        if (nb == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        nb->last = ngx_cpymem(nb->pos, b->pos, b->last - b->pos);
+        ngx_pfree(r->pool, b->start);
+        b = nb;
+    }
+
+    *out = b;
+
+    return rc;
+}
+
+static void *
+ngx_http_minify_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_minify_conf_t));
+    if (conf == NULL)
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bufs.num = 0;
+     *     conf->temp_path = NULL;
+     *     conf->cache_key = NULL;
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     *     conf->cache_watched = 0;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->streaming = NGX_CONF_UNSET;
+    conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->min_length = NGX_CONF_UNSET;
+    conf->max_length = NGX_CONF_UNSET;
+    conf->content_length = NGX_CONF_UNSET_SIZE;
+    conf->cpu_budget = NGX_CONF_UNSET_MSEC;
+    conf->cpu_deadline = NGX_CONF_UNSET_MSEC;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->thread_min_size = NGX_CONF_UNSET_SIZE;
+    conf->thread_split = NGX_CONF_UNSET_SIZE;
+    conf->thread_max_queue = NGX_CONF_UNSET_UINT;
+    conf->sniff = NGX_CONF_UNSET;
+    conf->skip_uri = NGX_CONF_UNSET_PTR;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_file = NGX_CONF_UNSET_PTR;
+    conf->worker_cache = NGX_CONF_UNSET_SIZE;
+    conf->cache_min_uses = NGX_CONF_UNSET_UINT;
+    conf->cache_lock = NGX_CONF_UNSET;
+    conf->cache_watch = NGX_CONF_UNSET;
+    conf->cache_content = NGX_CONF_UNSET;
+    conf->preload = NGX_CONF_UNSET_PTR;
+    conf->upstream_cache = NGX_CONF_UNSET;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+static char *
+ngx_http_minify_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_minify_conf_t *prev = parent;
+    ngx_http_minify_conf_t *conf = child;
+
+    size_t len;
+    ngx_uint_t i;
+    ngx_str_t *path;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_minify_preload_t *mp;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_value(conf->streaming, prev->streaming, 0);
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs,
+                              (128 * 1024) / ngx_pagesize, ngx_pagesize);
+    ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
+                              1024 * 1024);
+    ngx_conf_merge_off_value(conf->min_length, prev->min_length, 0);
+    ngx_conf_merge_off_value(conf->max_length, prev->max_length, 0);
+    ngx_conf_merge_size_value(conf->content_length, prev->content_length, 0);
+    ngx_conf_merge_msec_value(conf->cpu_budget, prev->cpu_budget, 0);
+    ngx_conf_merge_msec_value(conf->cpu_deadline, prev->cpu_deadline, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_uint_value(conf->thread_max_queue, prev->thread_max_queue,
+                              NGX_HTTP_MINIFY_THREAD_QUEUE);
+    ngx_conf_merge_size_value(conf->thread_min_size, prev->thread_min_size,
+                              256 * 1024);
+    ngx_conf_merge_size_value(conf->thread_split, prev->thread_split, 0);
+    ngx_conf_merge_value(conf->sniff, prev->sniff, 0);
+    ngx_conf_merge_ptr_value(conf->skip_uri, prev->skip_uri, NULL);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->cache_file, prev->cache_file, NULL);
+    ngx_conf_merge_size_value(conf->worker_cache, prev->worker_cache, 0);
+    ngx_conf_merge_uint_value(conf->cache_min_uses, prev->cache_min_uses, 1);
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+    ngx_conf_merge_value(conf->cache_watch, prev->cache_watch, 0);
+    ngx_conf_merge_value(conf->cache_content, prev->cache_content, 0);
+    ngx_conf_merge_value(conf->upstream_cache, prev->upstream_cache, 0);
+
+    /* the key of minify_cache_content, read in the master once */
+
+    if (conf->cache_content && ngx_http_minify_cache_hash_secret(cf->log) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (conf->cache_watch && conf->enable && conf->cache_zone)
+    {
+#if (NGX_LINUX)
+        /* roots with variables cannot be watched, stat keeps them right */
+
+        if (clcf->root_lengths == NULL && clcf->root.len)
+        {
+            if (ngx_http_minify_cache_watch_root(cf, conf->cache_zone, &clcf->root) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            conf->cache_watched = 1;
+        }
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"minify_cache_watch\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout, prev->cache_lock_timeout, 5000);
+
+    if (conf->cache_key == NULL)
+    {
+        conf->cache_key = prev->cache_key;
+    }
+
+    if (ngx_conf_merge_path_value(cf, &conf->temp_path, prev->temp_path,
+                                  &ngx_http_minify_temp_path) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
+                             &prev->types_keys, &prev->types,
+                             ngx_http_minify_default_types) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* minify_preload belongs to its own location, it is not inherited */
+
+    if (conf->preload == NGX_CONF_UNSET_PTR)
+    {
+        return NGX_CONF_OK;
+    }
+
+    if (!conf->enable || (conf->cache_zone == NULL && conf->cache_file == NULL))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"minify_preload\" requires \"minify\" and "
+                           "\"minify_cache_zone\" or \"minify_cache_file\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* requests would look for the key's value, which needs a request */
+
+    if (conf->cache_key)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"minify_preload\" cannot be used with \"minify_cache_key\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* the URI of a file is found by mapping its path back, see ngx_http_map_uri_to_path() */
+
+    if (clcf->root_lengths
+#if (NGX_PCRE)
+        || (clcf->alias && clcf->regex)
+#endif
+    )
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"minify_preload\" cannot be used with a root or alias "
+                           "that depends on the URI");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_minify_preloads == NULL)
+    {
+        ngx_http_minify_preloads = ngx_array_create(cf->pool, 4, sizeof(ngx_http_minify_preload_t));
+        if (ngx_http_minify_preloads == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    path = conf->preload->elts;
+
+    for (i = 0; i < conf->preload->nelts; i++)
+    {
+        if (path[i].len > 1 && path[i].data[path[i].len - 1] == '/')
+        {
+            path[i].len--;
+        }
+
+        if (ngx_conf_full_name(cf->cycle, &path[i], 0) != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        /* an alias may end with a slash, a root does not */
+
+        len = clcf->root.len;
+
+        if (len && clcf->root.data[len - 1] == '/')
+        {
+            len--;
+        }
+
+        if (path[i].len < len || ngx_strncmp(path[i].data, clcf->root.data, len) != 0 || (path[i].len > len && path[i].data[len] != '/'))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"minify_preload\" path \"%V\" is not under \"%V\"",
+                               &path[i], &clcf->root);
+            return NGX_CONF_ERROR;
+        }
+
+        mp = ngx_array_push(ngx_http_minify_preloads);
+        if (mp == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        mp->path = path[i];
+        mp->conf = conf;
+        mp->clcf = clcf;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * "200ms/s" 或 "200ms"：每个 worker 每秒最多用在引擎里的时间
+ */
+static char *
+ngx_http_minify_cpu_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_minify_conf_t *mcf = conf;
+
+    ngx_int_t n;
+    ngx_str_t *value, s;
+
+    if (mcf->cpu_budget != NGX_CONF_UNSET_MSEC)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    s = value[1];
+
+    if (s.len > 2 && ngx_strncmp(s.data + s.len - 2, "/s", 2) == 0)
+    {
+        s.len -= 2;
+    }
+
+    n = ngx_parse_time(&s, 0);
+
+    if (n == NGX_ERROR || n > 1000)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\", must be up to 1000ms per second", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->cpu_budget = (ngx_msec_t)n;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_minify_skip_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_PCRE)
+
+    ngx_http_minify_conf_t *mcf = conf;
+
+    u_char errstr[NGX_MAX_CONF_ERRSTR];
+    ngx_str_t *value;
+    ngx_uint_t i;
+    ngx_regex_elt_t *re;
+    ngx_regex_compile_t rc;
+
+    if (mcf->skip_uri == NGX_CONF_UNSET_PTR)
+    {
+        mcf->skip_uri = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
+        if (mcf->skip_uri == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        re = ngx_array_push(mcf->skip_uri);
+        if (re == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+        rc.pattern = value[i];
+        rc.options = NGX_REGEX_CASELESS;
+        rc.err.len = NGX_MAX_CONF_ERRSTR;
+        rc.err.data = errstr;
+
+        if (ngx_regex_compile(&rc) != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+            return NGX_CONF_ERROR;
+        }
+
+        re->regex = rc.regex;
+        re->name = value[i].data;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "using regex \"%V\" requires PCRE library",
+                       &((ngx_str_t *)cf->args->elts)[1]);
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+/*
+ * minify_thread_pool name [max_queue=number] | off
+ */
+static char *
+ngx_http_minify_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_minify_conf_t *mcf = conf;
+
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (mcf->thread_max_queue != NGX_CONF_UNSET_UINT)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mcf->thread_max_queue = NGX_HTTP_MINIFY_THREAD_QUEUE;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2)
+    {
+#if (NGX_THREADS)
+        mcf->thread_pool = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (cf->args->nelts > 2)
+    {
+        if (ngx_strncmp(value[2].data, "max_queue=", 10) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atoi(value[2].data + 10, value[2].len - 10);
+        if (n == NGX_ERROR || n == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid max_queue value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        mcf->thread_max_queue = (ngx_uint_t)n;
+    }
+
+#if (NGX_THREADS)
+
+    mcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (mcf->thread_pool == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"minify_thread_pool\" requires nginx built --with-threads");
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+static char *
+ngx_http_minify_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_minify_conf_t *mcf = conf;
+
+    u_char *p;
+    ssize_t size;
+    ngx_str_t *value, name, s;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_minify_cache_t *cache;
+
+    if (mcf->cache_zone != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0)
+    {
+        mcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    p = (u_char *)ngx_strchr(value[1].data, ':');
+
+    if (p == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\", must be name:size", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (name.len == 0 || size == NGX_ERROR)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t)(8 * ngx_pagesize))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_minify_filter_module);
+    if (shm_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL)
+    {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_minify_cache_t));
+        if (cache == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_http_minify_cache_init_zone;
+        shm_zone->data = cache;
+    }
+
+    mcf->cache_zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_minify_cache_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_minify_conf_t *mcf = conf;
+
+    ngx_str_t *value;
+
+    if (mcf->cache_file != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0)
+    {
+        mcf->cache_file = NULL;
+        return NGX_CONF_OK;
+    }
+
+    mcf->cache_file = ngx_http_minify_file_cache_zone(cf, &value[1]);
+    if (mcf->cache_file == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_status_variable(ngx_http_request_t *r,
+                                ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_minify_filter_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
+
+    if (ctx == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_http_minify_status_name[ctx->status].len;
+    v->data = ngx_http_minify_status_name[ctx->status].data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+#if (NGX_HTTP_CACHE)
+
+/*
+ * minify_upstream_cache：不在 body filter 里压缩，而是接在 upstream 的
+ * event pipe 的 input_filter 后面，所以写进 proxy_cache 的就是压缩结果，
+ * 条目头里的 valid_msec 记下这一点，命中时直接发缓存文件。input_filter 要等 input_filter_init 之后才确定
+ * （proxy 的 chunked），所以先替换 input_filter_init。
+ */
+static ngx_int_t
+ngx_http_minify_upstream_cache(ngx_http_request_t *r, ngx_http_minify_filter_ctx_t *ctx)
+{
+    ngx_http_upstream_t *u;
+
+    u = r->upstream;
+
+    if (ctx->type == NGX_HTTP_MINIFY_CSS)
+    {
+        ctx->cssmin = cssmin_create(r->pool);
+        if (ctx->cssmin == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+    else
+    {
+        ctx->jsmin = jsmin_create(r->pool);
+        if (ctx->jsmin == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* what reaches the body filter is minified already */
+
+    ctx->passed = 1;
+
+    ctx->input_filter_init = u->input_filter_init;
+    u->input_filter_init = ngx_http_minify_pipe_init;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_minify_filter_module);
+    ngx_http_clear_content_length(r);
+
+    return ngx_http_next_header_filter(r);
+}
+
+static ngx_int_t
+ngx_http_minify_pipe_init(void *data)
+{
+    ngx_http_request_t *r = data;
+
+    ngx_event_pipe_t *p;
+    ngx_http_minify_filter_ctx_t *ctx;
+    ngx_http_file_cache_header_t *h;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
+
+    if (ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->input_filter_init && ctx->input_filter_init(data) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    p = r->upstream->pipe;
+
+    if (p->length == -1)
+    {
+        /* ends when the connection closes, too late to flush the engine */
+
+        ctx->status = NGX_HTTP_MINIFY_PASSED;
+        return NGX_OK;
+    }
+
+    ctx->input_filter = p->input_filter;
+    p->input_filter = ngx_http_minify_pipe_filter;
+
+    /*
+     * mark the entry as minified; if minifying fails the response fails
+     * and the entry is not stored. The header may be in the buffer
+     * already, or be written from r->cache later
+     */
+
+    if (r->cache && r->upstream->cacheable)
+    {
+        r->cache->valid_msec = NGX_HTTP_MINIFY_UPSTREAM_MINIFIED;
+
+        if (p->buf_to_file && p->buf_to_file->start)
+        {
+            h = (ngx_http_file_cache_header_t *)p->buf_to_file->start;
+            h->valid_msec = NGX_HTTP_MINIFY_UPSTREAM_MINIFIED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * 上游的 input_filter 往 p->in 里加了 shadow 缓冲之后，在这些缓冲里原地压缩；
+ * 输出追上读指针时，剩下的写进一个新缓冲，接在后面。upstream_done 时最后
+ * 一个缓冲带 last，没有新缓冲就另加一个，把引擎里剩下的输出冲出来。
+ */
+static ngx_int_t
+ngx_http_minify_pipe_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    u_char *start;
+    ngx_int_t rc;
+    ngx_uint_t last;
+    ngx_buf_t *b, *nb, *out, in;
+    ngx_chain_t *cl, *ln, **last_in;
+    ngx_http_request_t *r;
+    ngx_http_minify_filter_ctx_t *ctx;
+
+    r = p->input_ctx;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_minify_filter_module);
+
+    last_in = p->last_in;
+
+    if (ctx->input_filter(p, buf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (cl = *last_in; cl && !ctx->done; cl = cl->next)
+    {
+        b = cl->buf;
+        start = b->pos;
+        last = p->upstream_done && cl->next == NULL;
+
+        out = &ctx->in_place_buf;
+
+        out->start = b->pos;
+        out->pos = b->pos;
+        out->last = b->pos;
+        out->end = b->last;
+
+        ctx->in_place = 1;
+
+        rc = ngx_http_minify_engine_run(ctx, b, out, last);
+
+        nb = NULL;
+
+        if (rc == NGX_BUSY)
+        {
+            /* b->pos is where the engine stopped reading */
+
+            ctx->in_place = 0;
+
+            rc = ngx_http_minify_run_all(r, ctx, b, last, &nb);
+
+            if (rc == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        b->pos = start;
+        b->last = out->last;
+
+        if (nb)
+        {
+            nb->tag = p->tag;
+
+            ln = ngx_alloc_chain_link(r->pool);
+            if (ln == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            ln->buf = nb;
+            ln->next = cl->next;
+            cl->next = ln;
+
+            if (p->last_in == &cl->next)
+            {
+                p->last_in = &ln->next;
+            }
+
+            cl = ln;
+        }
+
+        if (rc == NGX_OK)
+        {
+            ctx->done = 1;
+        }
+        else if (rc != NGX_AGAIN)
+        {
+            ngx_log_error(NGX_LOG_ERR, p->log, 0, "minify of upstream response failed");
+            return NGX_ERROR;
+        }
+    }
+
+    if (p->upstream_done && !ctx->done)
+    {
+        ngx_memzero(&in, sizeof(ngx_buf_t));
+
+        ctx->in_place = 0;
+        nb = NULL;
+
+        if (ngx_http_minify_run_all(r, ctx, &in, 1, &nb) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, p->log, 0, "minify of upstream response failed");
+            return NGX_ERROR;
+        }
+
+        nb->tag = p->tag;
+
+        ln = ngx_alloc_chain_link(r->pool);
+        if (ln == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ln->buf = nb;
+        ln->next = NULL;
+
+        *p->last_in = ln;
+        p->last_in = &ln->next;
+
+        ctx->done = 1;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+/*
+ * $minify_upstream_cache：当前 location 打开了 minify_upstream_cache 时是
+ * "minified"，放进 proxy_cache_key 里，和未压缩的缓存条目区分开。
+ */
+static ngx_int_t
+ngx_http_minify_upstream_cache_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_minify_conf_t *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (conf->enable && conf->upstream_cache)
+    {
+        v->len = sizeof("minified") - 1;
+        v->data = (u_char *)"minified";
+    }
+    else
+    {
+        v->len = 0;
+        v->data = (u_char *)"";
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * $minify_cache_*：当前 location 的 minify_cache_zone 的计数，
+ * data 是 ngx_http_minify_cache_stats_t 里的偏移，hit_ratio 用 -1 表示。
+ */
+static ngx_int_t
+ngx_http_minify_cache_variable(ngx_http_request_t *r,
+                               ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_uint_t n, total;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_minify_cache_stats_t stats;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_minify_filter_module);
+
+    if (conf->cache_zone == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ngx_http_minify_cache_stats(conf->cache_zone, &stats);
+
+    if (data == (uintptr_t)-1)
+    {
+        total = stats.hits + stats.misses;
+        n = total ? stats.hits * 100 / total : 0;
+    }
+    else
+    {
+        n = *(ngx_uint_t *)((char *)&stats + data);
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", n) - p;
+    v->data = p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_preconfiguration(ngx_conf_t *cf)
+{
+    /* left over from the previous configuration in the master */
+
+    ngx_http_minify_preloads = NULL;
+
+    return ngx_http_minify_add_variables(cf);
+}
+
+static ngx_int_t
+ngx_http_minify_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_minify_vars; v->name.len; v++)
+    {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_minify_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_minify_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_minify_body_filter;
+
+    return NGX_OK;
+}
+
+/*
+ * minify_cache_watch 的 inotify、minify_cache_path 的加载和过期，以及
+ * minify_preload 的预热都只在 0 号 worker 里运行。
+ */
+static ngx_int_t
+ngx_http_minify_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_minify_preloader_t *pl;
+
+    if ((ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */; i++)
+    {
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_minify_filter_module)
+        {
+            continue;
+        }
+
+        /* a zone that cannot be watched is still checked by stat */
+
+        (void)ngx_http_minify_cache_watch(cycle, &shm_zone[i]);
+    }
+
+    if (ngx_http_minify_file_cache_init_process(cycle) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_minify_preloads == NULL)
+    {
+        return NGX_OK;
+    }
+
+    pl = ngx_pcalloc(cycle->pool, sizeof(ngx_http_minify_preloader_t));
+    if (pl == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    pl->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (pl->pool == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&pl->dirs, pl->pool, 8, sizeof(ngx_http_minify_preload_dir_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    pl->event.handler = ngx_http_minify_preload_handler;
+    pl->event.data = pl;
+    pl->event.log = cycle->log;
+    pl->event.cancelable = 1;
+
+    /* after the listening sockets are in the event loop */
+
+    ngx_add_timer(&pl->event, NGX_HTTP_MINIFY_PRELOAD_SLEEP);
+
+    return NGX_OK;
+}
+
+/*
+ * 0 号 worker 退出时关掉 minify_cache_watch 的 inotify 描述符。
+ */
+static void
+ngx_http_minify_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_shm_zone_t *shm_zone;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */; i++)
+    {
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag == &ngx_http_minify_filter_module)
+        {
+            ngx_http_minify_cache_unwatch(&shm_zone[i]);
+        }
+    }
+}
+
+/*
+ * minify_preload：每批最多 NGX_HTTP_MINIFY_PRELOAD_FILES 个文件或者
+ * NGX_HTTP_MINIFY_PRELOAD_THRESHOLD 毫秒，然后让出事件循环
+ * NGX_HTTP_MINIFY_PRELOAD_SLEEP 毫秒，所以预热期间照样接受连接。
+ */
+static void
+ngx_http_minify_preload_handler(ngx_event_t *ev)
+{
+    ngx_int_t rc;
+    ngx_uint_t n, usec;
+    ngx_http_minify_preloader_t *pl;
+
+    pl = ev->data;
+
+    usec = ngx_http_minify_usec();
+
+    for (n = 0; n < NGX_HTTP_MINIFY_PRELOAD_FILES; /* void */)
+    {
+        if (ngx_http_minify_usec() - usec >= NGX_HTTP_MINIFY_PRELOAD_THRESHOLD * 1000)
+        {
+            break;
+        }
+
+        rc = ngx_http_minify_preload_next(pl);
+
+        if (rc == NGX_DONE)
+        {
+            ngx_destroy_pool(pl->pool);
+            return;
+        }
+
+        if (rc == NGX_OK)
+        {
+            n++;
+        }
+    }
+
+    if (pl->preload && ngx_current_msec - pl->logged >= NGX_HTTP_MINIFY_PRELOAD_PROGRESS)
+    {
+        ngx_http_minify_preload_log(pl, "in progress");
+        pl->logged = ngx_current_msec;
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_MINIFY_PRELOAD_SLEEP);
+}
+
+/*
+ * 走一步：开始下一个目录，读一个目录项，或者处理一个文件；处理了文件时
+ * 返回 NGX_OK，全部完成时返回 NGX_DONE。
+ */
+static ngx_int_t
+ngx_http_minify_preload_next(ngx_http_minify_preloader_t *pl)
+{
+    u_char *p;
+    size_t len;
+    ngx_err_t err;
+    ngx_str_t name, path;
+    ngx_log_t *log;
+    ngx_http_minify_preload_t *preloads;
+    ngx_http_minify_preload_dir_t *d;
+
+    log = pl->event.log;
+
+    if (pl->dirs.nelts == 0)
+    {
+        if (pl->preload)
+        {
+            ngx_http_minify_preload_log(pl, "done");
+        }
+
+        if (pl->next == ngx_http_minify_preloads->nelts)
+        {
+            return NGX_DONE;
+        }
+
+        preloads = ngx_http_minify_preloads->elts;
+        pl->preload = &preloads[pl->next++];
+
+        pl->start = ngx_current_msec;
+        pl->logged = ngx_current_msec;
+        pl->files = 0;
+        pl->minified = 0;
+        pl->cached = 0;
+        pl->large = 0;
+        pl->failed = 0;
+        pl->size = 0;
+        pl->produced = 0;
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "minify preload of \"%V\" started", &pl->preload->path);
+
+        d = ngx_array_push(&pl->dirs);
+        if (d == NULL)
+        {
+            return NGX_DONE;
+        }
+
+        d->path = pl->preload->path;
+
+        if (ngx_open_dir(&d->path, &d->dir) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_dir_n " \"%V\" failed", &d->path);
+            pl->dirs.nelts--;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    d = (ngx_http_minify_preload_dir_t *)pl->dirs.elts + pl->dirs.nelts - 1;
+
+    ngx_set_errno(0);
+
+    if (ngx_read_dir(&d->dir) == NGX_ERROR)
+    {
+        err = ngx_errno;
+
+        if (err != NGX_ENOMOREFILES)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_read_dir_n " \"%V\" failed", &d->path);
+        }
+
+        if (ngx_close_dir(&d->dir) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_close_dir_n " \"%V\" failed", &d->path);
+        }
+
+        pl->dirs.nelts--;
+
+        return NGX_AGAIN;
+    }
+
+    len = ngx_de_namelen(&d->dir);
+    name.data = ngx_de_name(&d->dir);
+
+    /* "." and "..", and hidden files, as ngx_walk_tree() does */
+
+    if (name.data[0] == '.')
+    {
+        return NGX_AGAIN;
+    }
+
+    path.len = d->path.len + 1 + len;
+
+    if (path.len + 1 > pl->name_size)
+    {
+        pl->name_size = ngx_max(2 * pl->name_size, path.len + 1);
+
+        pl->name = ngx_pnalloc(pl->pool, pl->name_size);
+        if (pl->name == NULL)
+        {
+            return NGX_DONE;
+        }
+    }
+
+    path.data = pl->name;
+
+    p = ngx_cpymem(path.data, d->path.data, d->path.len);
+    *p++ = '/';
+    ngx_memcpy(p, name.data, len + 1);
+
+    if (!d->dir.valid_info && ngx_de_info(path.data, &d->dir) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_de_info_n " \"%V\" failed", &path);
+        return NGX_AGAIN;
+    }
+
+    if (ngx_de_is_dir(&d->dir))
+    {
+        d = ngx_array_push(&pl->dirs);
+        if (d == NULL)
+        {
+            return NGX_DONE;
+        }
+
+        /* with the terminating zero, for ngx_open_dir() */
+
+        d->path.len = path.len;
+        d->path.data = ngx_pnalloc(pl->pool, path.len + 1);
+        if (d->path.data == NULL)
+        {
+            return NGX_DONE;
+        }
+
+        ngx_memcpy(d->path.data, path.data, path.len + 1);
+
+        if (ngx_open_dir(&d->path, &d->dir) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_dir_n " \"%V\" failed", &d->path);
+            pl->dirs.nelts--;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (!ngx_de_is_file(&d->dir))
+    {
+        return NGX_AGAIN;
+    }
+
+    (void)ngx_http_minify_preload_file(pl, &path);
+
+    return NGX_OK;
+}
+
+/*
+ * 按文件路径和扩展名的类型算出和请求时相同的 key；两个缓存里都有了
+ * 就跳过，否则读入整个文件压缩后存入。读和压缩都是同步的，超过
+ * minify_max_buffer_size 的文件不预热，留给请求时处理。
+ */
+static ngx_int_t
+ngx_http_minify_preload_file(ngx_http_minify_preloader_t *pl, ngx_str_t *path)
+{
+    u_char *p, *exten, *lowcase;
+    size_t len;
+    ssize_t n;
+    uint32_t path_hash;
+    ngx_int_t rc;
+    ngx_uint_t type, hash, need;
+    ngx_buf_t *in, *out, *b;
+    ngx_md5_t md5, name_md5;
+    ngx_str_t *content_type;
+    ngx_log_t *log;
+    ngx_pool_t *pool;
+    off_t size;
+    time_t mtime;
+    ngx_file_t file;
+    ngx_file_uniq_t uniq;
+    ngx_file_info_t fi;
+    ngx_atomic_uint_t generation;
+    ngx_http_minify_conf_t *conf;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_minify_filter_ctx_t *ctx;
+    u_char name[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+    u_char key[NGX_HTTP_MINIFY_CACHE_KEY_LEN];
+#if (NGX_PCRE)
+    ngx_str_t uri;
+#endif
+
+    log = pl->event.log;
+    conf = pl->preload->conf;
+    clcf = pl->preload->clcf;
+
+    /* the type the request would get, by extension */
+
+    exten = NULL;
+
+    for (p = path->data + path->len - 1; p > path->data && *p != '/'; p--)
+    {
+        if (*p == '.')
+        {
+            exten = p + 1;
+            break;
+        }
+    }
+
+    if (exten == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = NGX_INVALID_FILE;
+    file.name = *path;
+    file.log = log;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_DECLINED;
+
+    len = path->data + path->len - exten;
+
+    lowcase = ngx_pnalloc(pool, len);
+    if (lowcase == NULL)
+    {
+        goto failed;
+    }
+
+    hash = ngx_hash_strlow(lowcase, exten, len);
+    content_type = ngx_hash_find(&clcf->types_hash, hash, lowcase, len);
+
+    if (content_type == NULL)
+    {
+        goto done;
+    }
+
+    if (conf->types.size)
+    {
+        lowcase = ngx_pnalloc(pool, content_type->len);
+        if (lowcase == NULL)
+        {
+            goto failed;
+        }
+
+        hash = ngx_hash_strlow(lowcase, content_type->data, content_type->len);
+
+        if (ngx_hash_find(&conf->types, hash, lowcase, content_type->len) == NULL)
+        {
+            goto done;
+        }
+    }
+
+    if (ngx_strlcasestrn(content_type->data, content_type->data + content_type->len, (u_char *)"javascript", 10 - 1) != NULL)
+    {
+        type = NGX_HTTP_MINIFY_JS;
+    }
+    else if (ngx_strlcasestrn(content_type->data, content_type->data + content_type->len, (u_char *)"css", 3 - 1) != NULL)
+    {
+        type = NGX_HTTP_MINIFY_CSS;
+    }
+    else
+    {
+        goto done;
+    }
+
+#if (NGX_PCRE)
+    if (conf->skip_uri)
+    {
+        /* the URI that maps to this path */
+
+        len = path->len - clcf->root.len;
+
+        if (clcf->alias)
+        {
+            uri.len = clcf->alias + len;
+
+            uri.data = ngx_pnalloc(pool, uri.len);
+            if (uri.data == NULL)
+            {
+                goto failed;
+            }
+
+            p = ngx_cpymem(uri.data, clcf->name.data, clcf->alias);
+            ngx_memcpy(p, path->data + clcf->root.len, len);
+        }
+        else
+        {
+            uri.len = len;
+            uri.data = path->data + clcf->root.len;
+        }
+
+        if (ngx_regex_exec_array(conf->skip_uri, &uri, log) == NGX_OK)
+        {
+            goto done;
+        }
+    }
+#endif
+
+    /* as ngx_http_minify_cache_key(), by the path the URI maps to */
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, &type, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, path->data, path->len);
+
+    name_md5 = md5;
+    ngx_md5_final(name, &name_md5);
+
+    path_hash = 0;
+    generation = 0;
+
+    if (conf->cache_watched)
+    {
+        path_hash = ngx_http_minify_cache_path_hash(path->data, path->len);
+        generation = ngx_http_minify_cache_generation(conf->cache_zone, path_hash);
+    }
+
+    file.fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", path);
+        goto failed;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", path);
+        goto failed;
+    }
+
+    uniq = ngx_file_uniq(&fi);
+    mtime = ngx_file_mtime(&fi);
+    size = ngx_file_size(&fi);
+
+    if (ngx_http_minify_out_of_range(conf, size))
+    {
+        goto done;
+    }
+
+    pl->files++;
+
+    /* read and minified at once, so the worker would stall on it */
+
+    if (size > (off_t)conf->max_buffer_size)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "minify preload skips \"%V\" of %O bytes, "
+                      "above minify_max_buffer_size", path, size);
+        pl->large++;
+        goto done;
+    }
+
+    /* as in ngx_http_minify_cache_key() */
+
+    ngx_md5_update(&md5, &uniq, sizeof(ngx_file_uniq_t));
+    ngx_md5_update(&md5, &mtime, sizeof(time_t));
+    ngx_md5_update(&md5, &size, sizeof(off_t));
+    ngx_md5_final(key, &md5);
+
+    need = (conf->cache_zone && !ngx_http_minify_cache_exists(conf->cache_zone, key));
+
+    if (conf->cache_file)
+    {
+        rc = ngx_http_minify_file_cache_exists(conf->cache_file, key, pool, log);
+
+        if (rc == NGX_ERROR)
+        {
+            goto failed;
+        }
+
+        need |= (rc == NGX_DECLINED);
+        rc = NGX_DECLINED;
+    }
+
+    if (!need)
+    {
+        pl->cached++;
+        goto done;
+    }
+
+    len = (size_t)size;
+
+    in = ngx_create_temp_buf(pool, len + 1);
+    out = ngx_create_temp_buf(pool, len + 1);
+
+    if (in == NULL || out == NULL)
+    {
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, in->pos, len, 0);
+
+    if (n != (ssize_t)len)
+    {
+        if (n != NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          ngx_read_file_n " read only %z of %uz from \"%V\"",
+                          n, len, path);
+        }
+
+        goto failed;
+    }
+
+    in->last += len;
+    in->last_buf = 1;
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_http_minify_filter_ctx_t));
+    if (ctx == NULL)
+    {
+        goto failed;
+    }
+
+    ctx->type = type;
+
+    if (type == NGX_HTTP_MINIFY_CSS)
+    {
+        ctx->cssmin = cssmin_create(pool);
+        if (ctx->cssmin == NULL)
+        {
+            goto failed;
+        }
+    }
+    else
+    {
+        ctx->jsmin = jsmin_create(pool);
+        if (ctx->jsmin == NULL)
+        {
+            goto failed;
+        }
+    }
+
+    for (;;)
+    {
+        rc = ngx_http_minify_engine_run(ctx, in, out, 1);
+
+        if (rc != NGX_BUSY)
+        {
+            break;
+        }
+
+        /* output larger than the input, rare */
+
+        b = ngx_create_temp_buf(pool, 2 * (out->end - out->start));
+        if (b == NULL)
+        {
+            goto failed;
+        }
+
+        b->last = ngx_cpymem(b->pos, out->pos, out->last - out->pos);
+        out = b;
+    }
+
+    if (rc != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "minify preload of \"%V\" failed", path);
+        goto failed;
+    }
+
+    if (conf->cache_zone)
+    {
+        (void)ngx_http_minify_cache_store(conf->cache_zone, key, name, path_hash, generation,
+                                          out->pos, out->last - out->pos, 0, log);
+    }
+
+    if (conf->cache_file)
+    {
+        (void)ngx_http_minify_file_cache_store(conf->cache_file, key, out->pos,
+                                               out->last - out->pos, pool, log);
+    }
+
+    pl->minified++;
+    pl->size += len;
+    pl->produced += out->last - out->pos;
+
+    rc = NGX_OK;
+
+    goto done;
+
+failed:
+
+    pl->failed++;
+    rc = NGX_ERROR;
+
+done:
+
+    if (file.fd != NGX_INVALID_FILE && ngx_close_file(file.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", path);
+    }
+
+    ngx_destroy_pool(pool);
+
+    return rc;
+}
+
+static void
+ngx_http_minify_preload_log(ngx_http_minify_preloader_t *pl, const char *what)
+{
+    ngx_log_error(NGX_LOG_NOTICE, pl->event.log, 0,
+                  "minify preload of \"%V\" %s after %M ms: %ui files, "
+                  "%ui minified from %O to %O bytes, %ui cached already, "
+                  "%ui too large, %ui failed",
+                  &pl->preload->path, what, ngx_current_msec - pl->start,
+                  pl->files, pl->minified, pl->size, pl->produced,
+                  pl->cached, pl->large, pl->failed);
+}
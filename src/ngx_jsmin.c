@@ -25,29 +25,95 @@
  * SOFTWARE.
  */
 
+
+/*
+ * The engine is a resumable state machine: jsmin() consumes as much of the
+ * input buffer as it can and returns NGX_AGAIN when it runs dry, keeping
+ * theA/theB, the lookahead and its position inside action() and next() in
+ * the context, so the next chain link picks up exactly where this one
+ * stopped.
+ */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <ngx_config.h>
 #include <ngx_core.h>
+#include "ngx_jsmin.h"
 
-static int theA, theB, theLookahead = EOF, theX = EOF, theY = EOF;
-
-static int ngx_getc(ngx_buf_t *in)
+/* position inside action() */
+enum
+{
+    sw_start = 0,
+    sw_bom,
+    sw_action3,
+    sw_string,
+    sw_string_escape,
+    sw_regex,
+    sw_regex_escape,
+    sw_regex_class,
+    sw_regex_class_escape,
+    sw_regex_end,
+    sw_done
+};
+
+/* position inside next() */
+enum
+{
+    sw_code = 0,
+    sw_slash,
+    sw_line_comment,
+    sw_block_comment,
+    sw_block_star
+};
+
+static int ngx_getc(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in)
 {
     if (in->pos >= in->last)
     {
-        return EOF;
+        return ctx->last ? EOF : NGX_JSMIN_AGAIN;
     }
     u_char c = in->pos[0];
     ++in->pos;
     return c;
 }
 
-static void ngx_putc(u_char c, ngx_buf_t *out)
+/*
+ * ngx_out_end -- where the output has to stop. In place the output shares
+ * memory with the input and must stay behind the read cursor.
+ */
+
+static u_char *ngx_out_end(ngx_jsmin_ctx_t *ctx, ngx_buf_t *out)
 {
-    if (out->pos <= out->end)
+    return ctx->in_place ? ctx->in->pos : out->end;
+}
+
+/*
+ * ngx_putc -- once the output buffer is full, characters go to the carry
+ * and jsmin() returns NGX_BUSY at the end of the current step.
+ */
+
+static void ngx_putc(ngx_jsmin_ctx_t *ctx, u_char c, ngx_buf_t *out)
+{
+    if (ctx->ncarry == 0 && out->last < ngx_out_end(ctx, out))
     {
-        out->pos[0] = c;
-        ++out->pos;
+        out->last[0] = c;
+        ++out->last;
+        return;
+    }
+    ctx->carry[ctx->ncarry++] = c;
+}
+
+static void ngx_flush_carry(ngx_jsmin_ctx_t *ctx, ngx_buf_t *out)
+{
+    size_t n;
+
+    n = ngx_min(ctx->ncarry, (size_t)(ngx_out_end(ctx, out) - out->last));
+    out->last = ngx_cpymem(out->last, ctx->carry, n);
+
+    ctx->ncarry -= n;
+    if (ctx->ncarry)
+    {
+        ngx_memmove(ctx->carry, ctx->carry + n, ctx->ncarry);
     }
 }
 
@@ -62,21 +128,21 @@ static int isAlphanum(int c)
 }
 
 /* 
- * get -- return the next character from stdin. Watch out for lookahead. If
- * the character is a control character, translate it to a space or
+ * get -- return the next character from the input. Watch out for lookahead.
+ * If the character is a control character, translate it to a space or
  * linefeed.
  */
 
-static int get(ngx_buf_t *in)
+static int get(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in)
 {
-    int c = theLookahead;
-    theLookahead = EOF;
+    int c = ctx->theLookahead;
+    ctx->theLookahead = EOF;
 
     if (c == EOF)
     {
-        c = ngx_getc(in);
+        c = ngx_getc(ctx, in);
     }
-    if (c >= ' ' || c == '\n' || c == EOF)
+    if (c >= ' ' || c == '\n' || c == EOF || c == NGX_JSMIN_AGAIN)
     {
         return c;
     }
@@ -91,62 +157,121 @@ static int get(ngx_buf_t *in)
  * peek -- get the next character without getting it.
  */
 
-static int peek(ngx_buf_t *in)
+static int peek(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in)
 {
-    theLookahead = get(in);
-    return theLookahead;
+    int c = get(ctx, in);
+    if (c != NGX_JSMIN_AGAIN)
+    {
+        ctx->theLookahead = c;
+    }
+    return c;
 }
 
 /*
  * next -- get the next character, excluding comments. peek() is used to see
- * if a '/' is followed by a '/' or '*'.
+ * if a '/' is followed by a '/' or '*'. Returns NGX_JSMIN_AGAIN with the
+ * comment state saved when the input runs out.
  */
 
-static int next(ngx_buf_t *in)
+static int next(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in)
 {
-    int c = get(in);
-    if (c == '/')
+    int c;
+
+    for (;;)
     {
-        switch (peek(in))
+        switch (ctx->comment)
         {
 
-        case '/':
-            for (;;)
+        case sw_code:
+            c = get(ctx, in);
+            if (c != '/')
             {
-                c = get(in);
-                if (c <= '\n')
-                {
-                    break;
-                }
+                goto done;
             }
-            break;
+            ctx->comment = sw_slash;
+
+            /* fall through */
 
-        case '*':
-            get(in);
-            while (c != ' ')
+        case sw_slash:
+            c = peek(ctx, in);
+            if (c == '/')
             {
-                switch (get(in))
-                {
+                ctx->comment = sw_line_comment;
+                break;
+            }
+            if (c == '*')
+            {
+                get(ctx, in);
+                ctx->comment = sw_block_comment;
+                break;
+            }
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return c;
+            }
+            ctx->comment = sw_code;
+            c = '/';
+            goto done;
 
-                case '*':
-                    if (peek(in) == '/')
-                    {
-                        get(in);
-                        c = ' ';
-                    }
-                    break;
+        case sw_line_comment:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return c;
+            }
+            if (c <= '\n')
+            {
+                ctx->comment = sw_code;
+                goto done;
+            }
+            break;
 
-                case EOF:
-                    break; /* Unterminated comment. */
-                }
+        case sw_block_comment:
+            c = get(ctx, in);
+            if (c == '*')
+            {
+                ctx->comment = sw_block_star;
+            }
+            else if (c == EOF)
+            {
+                /* Unterminated comment. */
+                ctx->comment = sw_code;
+                c = ' ';
+                goto done;
             }
+            else if (c == NGX_JSMIN_AGAIN)
+            {
+                return c;
+            }
+            break;
 
+        case sw_block_star:
+            c = peek(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return c;
+            }
+            if (c == '/')
+            {
+                get(ctx, in);
+                ctx->comment = sw_code;
+                c = ' ';
+                goto done;
+            }
+            ctx->comment = sw_block_comment;
             break;
         }
     }
 
-    theY = theX;
-    theX = c;
+done:
+
+    if (c == NGX_JSMIN_AGAIN)
+    {
+        return c;
+    }
+
+    ctx->theY = ctx->theX;
+    ctx->theX = c;
 
     return c;
 }
@@ -158,195 +283,372 @@ static int next(ngx_buf_t *in)
  *       3   Get the next B. (Delete B).
  *  action treats a string as a single character. Wow!
  *  action recognizes a regular expression if it is preceded by ( or , or =.
+ *
+ *  Strings, regular expressions and getting the next B are continued by the
+ *  states in jsmin(), so action() itself never reads input.
 */
 
-static void action(int d, ngx_buf_t *in, ngx_buf_t *out)
+static void action(ngx_jsmin_ctx_t *ctx, int d, ngx_buf_t *out)
 {
     switch (d)
     {
 
     case 1:
-        ngx_putc(theA, out);
-        if ((theY == '\n' || theY == ' ') && (theA == '+' || theA == '-' || theA == '*' || theA == '/') && (theB == '+' || theB == '-' || theB == '*' || theB == '/'))
+        ngx_putc(ctx, ctx->theA, out);
+        if ((ctx->theY == '\n' || ctx->theY == ' ') && (ctx->theA == '+' || ctx->theA == '-' || ctx->theA == '*' || ctx->theA == '/') && (ctx->theB == '+' || ctx->theB == '-' || ctx->theB == '*' || ctx->theB == '/'))
         {
-            ngx_putc(theY, out);
+            ngx_putc(ctx, ctx->theY, out);
         }
 
+        /* fall through */
+
     case 2:
-        theA = theB;
-        if (theA == '\'' || theA == '"' || theA == '`')
+        ctx->theA = ctx->theB;
+        if (ctx->theA == '\'' || ctx->theA == '"' || ctx->theA == '`')
         {
-            for (;;)
-            {
-                ngx_putc(theA, out);
-                theA = get(in);
-                if (theA == theB)
-                {
-                    break;
-                }
-                if (theA == '\\')
-                {
-                    ngx_putc(theA, out);
-                    theA = get(in);
-                }
-                if (theA == EOF)
-                {
-                    break; /* Unterminated string literal. */
-                }
-            }
+            ngx_putc(ctx, ctx->theA, out);
+            ctx->state = sw_string;
+            return;
         }
 
+        /* fall through */
+
     case 3:
-        theB = next(in);
-        if (theB == '/' && (theA == '(' || theA == ',' || theA == '=' || theA == ':' || theA == '[' || theA == '!' || theA == '&' || theA == '|' || theA == '?' || theA == '+' || theA == '-' || theA == '~' || theA == '*' || theA == '/' || theA == '\n'))
+        ctx->state = sw_action3;
+    }
+}
+
+/*
+ * dispatch -- one iteration of the main loop, run once the next B is known.
+ */
+
+static void dispatch(ngx_jsmin_ctx_t *ctx, ngx_buf_t *out)
+{
+    if (ctx->theA == EOF)
+    {
+        ctx->state = sw_done;
+        return;
+    }
+
+    switch (ctx->theA)
+    {
+
+    case ' ':
+        action(ctx, isAlphanum(ctx->theB) ? 1 : 2, out);
+        break;
+
+    case '\n':
+        switch (ctx->theB)
         {
-            ngx_putc(theA, out);
-            if (theA == '/' || theA == '*')
-            {
-                ngx_putc(' ', out);
-            }
 
-            ngx_putc(theB, out);
+        case '{':
+        case '[':
+        case '(':
+        case '+':
+        case '-':
+        case '!':
+        case '~':
+            action(ctx, 1, out);
+            break;
+
+        case ' ':
+            action(ctx, 3, out);
+            break;
+
+        default:
+            action(ctx, isAlphanum(ctx->theB) ? 1 : 2, out);
+        }
+        break;
+
+    default:
+        switch (ctx->theB)
+        {
+
+        case ' ':
+            action(ctx, isAlphanum(ctx->theA) ? 1 : 3, out);
+            break;
 
-            for (;;)
+        case '\n':
+            switch (ctx->theA)
             {
-                theA = get(in);
-                if (theA == '[')
-                {
-                    for (;;)
-                    {
-                        ngx_putc(theA, out);
-                        theA = get(in);
-                        if (theA == ']')
-                        {
-                            break;
-                        }
-                        if (theA == '\\')
-                        {
-                            ngx_putc(theA, out);
-                            theA = get(in);
-                        }
-                        if (theA == EOF)
-                        {
-                            break; /* Unterminated set in Regular Expression literal.*/
-                        }
-                    }
-                }
-                else if (theA == '/')
-                {
-                    switch (peek(in))
-                    {
-                    case '/':
-                    case '*':
-                        break; /* Unterminated set in Regular Expression literal.*/
-                    }
-
-                    break;
-                }
-                else if (theA == '\\')
-                {
-                    ngx_putc(theA, out);
-                    theA = get(in);
-                }
-                if (theA == EOF)
-                {
-                    break; /* Unterminated Regular Expression literal.*/
-                }
 
-                ngx_putc(theA, out);
+            case '}':
+            case ']':
+            case ')':
+            case '+':
+            case '-':
+            case '"':
+            case '\'':
+            case '`':
+                action(ctx, 1, out);
+                break;
+
+            default:
+                action(ctx, isAlphanum(ctx->theA) ? 1 : 3, out);
             }
+            break;
 
-            theB = next(in);
+        default:
+            action(ctx, 1, out);
+            break;
         }
     }
 }
 
+/*
+ * jsmin_create -- allocate the per-request minifier state. Every invocation
+ * of jsmin() needs its own context, nothing is shared between requests.
+ */
+
+ngx_jsmin_ctx_t *jsmin_create(ngx_pool_t *pool)
+{
+    ngx_jsmin_ctx_t *ctx;
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_jsmin_ctx_t));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     ctx->state = sw_start;
+     *     ctx->comment = sw_code;
+     *     ctx->ncarry = 0;
+     *     ctx->last = 0;
+     */
+
+    ctx->theLookahead = EOF;
+    ctx->theX = EOF;
+    ctx->theY = EOF;
+
+    return ctx;
+}
+
+/*
+ * jsmin_resume -- start a fresh context in the middle of a script, in the
+ * state jsmin() is in once a linefeed has been read and theA is the last
+ * character kept, so pieces of one script can be minified separately.
+ * theX and theY only matter when theA is an operator, which it never is
+ * here.
+ */
+
+void jsmin_resume(ngx_jsmin_ctx_t *ctx, int a)
+{
+    ctx->theA = a;
+    ctx->state = sw_action3;
+}
+
+/*
+ * jsmin_resumable -- true when ctx, having run out of input, is in the
+ * state jsmin_resume(ctx, a) sets up: not inside a string, regex or
+ * comment, nothing looked ahead and nothing left to write.
+ */
+
+ngx_uint_t jsmin_resumable(ngx_jsmin_ctx_t *ctx, int a)
+{
+    return ctx->state == sw_action3 && ctx->comment == sw_code && ctx->theA == a && ctx->theLookahead == EOF && ctx->ncarry == 0;
+}
+
 /* 
  *  jsmin -- Copy the input to the output, deleting the characters which are
  *  insignificant to JavaScript. Comments will be removed. Tabs will be
  *  replaced with spaces. Carriage returns will be replaced with linefeeds.
  *  Most spaces and linefeeds will be removed.
+ *
+ *  Output is appended at out->last. Returns NGX_AGAIN when the input buffer
+ *  is exhausted, NGX_BUSY when the output buffer is full and NGX_OK once the
+ *  last input buffer (ctx->last) has been minified completely.
+ *
+ *  With ctx->in_place set, out points into the input buffer itself and the
+ *  output trails in->pos. The output is almost never longer than what has
+ *  been read; if it catches up with the read cursor, NGX_BUSY is returned
+ *  and the caller continues into a separate buffer.
 */
 
-void jsmin(ngx_buf_t *in, ngx_buf_t *out)
+ngx_int_t jsmin(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out)
 {
-    if (peek(in) == 0xEF)
-    {
-        get(in);
-        get(in);
-        get(in);
-    }
+    int c;
+
+    ctx->in = in;
+
+    ngx_flush_carry(ctx, out);
 
-    theA = '\n';
-    action(3, in, out);
-    while (theA != EOF)
+    for (;;)
     {
-        switch (theA)
+        if (ctx->ncarry)
         {
+            return NGX_BUSY;
+        }
 
-        case ' ':
-            action(isAlphanum(theB) ? 1 : 2, in, out);
+        switch (ctx->state)
+        {
+
+        case sw_start:
+            c = peek(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            if (c == 0xEF)
+            {
+                get(ctx, in);
+                ctx->bom = 2;
+                ctx->state = sw_bom;
+                break;
+            }
+            ctx->theA = '\n';
+            ctx->state = sw_action3;
             break;
 
-        case '\n':
-            switch (theB)
+        case sw_bom:
+            if (get(ctx, in) == NGX_JSMIN_AGAIN)
             {
+                return NGX_AGAIN;
+            }
+            if (--ctx->bom == 0)
+            {
+                ctx->theA = '\n';
+                ctx->state = sw_action3;
+            }
+            break;
 
-            case '{':
-            case '[':
-            case '(':
-            case '+':
-            case '-':
-            case '!':
-            case '~':
-                action(1, in, out);
-                break;
+        case sw_action3:
+            c = next(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theB = c;
+            if (ctx->theB == '/' && (ctx->theA == '(' || ctx->theA == ',' || ctx->theA == '=' || ctx->theA == ':' || ctx->theA == '[' || ctx->theA == '!' || ctx->theA == '&' || ctx->theA == '|' || ctx->theA == '?' || ctx->theA == '+' || ctx->theA == '-' || ctx->theA == '~' || ctx->theA == '*' || ctx->theA == '/' || ctx->theA == '\n'))
+            {
+                ngx_putc(ctx, ctx->theA, out);
+                if (ctx->theA == '/' || ctx->theA == '*')
+                {
+                    ngx_putc(ctx, ' ', out);
+                }
 
-            case ' ':
-                action(3, in, out);
+                ngx_putc(ctx, ctx->theB, out);
+                ctx->state = sw_regex;
                 break;
-
-            default:
-                action(isAlphanum(theB) ? 1 : 2, in, out);
             }
+            dispatch(ctx, out);
             break;
 
-        default:
-            switch (theB)
+        case sw_string:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theA = c;
+            if (c == ctx->theB || c == EOF)
+            {
+                /* EOF: Unterminated string literal. */
+                ctx->state = sw_action3;
+                break;
+            }
+            ngx_putc(ctx, c, out);
+            if (c == '\\')
             {
+                ctx->state = sw_string_escape;
+            }
+            break;
 
-            case ' ':
-                action(isAlphanum(theA) ? 1 : 3, in, out);
+        case sw_string_escape:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theA = c;
+            if (c == EOF)
+            {
+                ctx->state = sw_action3;
                 break;
+            }
+            ngx_putc(ctx, c, out);
+            ctx->state = sw_string;
+            break;
 
-            case '\n':
-                switch (theA)
-                {
+        case sw_regex:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theA = c;
+            if (c == '/' || c == EOF)
+            {
+                /* EOF: Unterminated Regular Expression literal. */
+                ctx->state = sw_regex_end;
+                break;
+            }
+            ngx_putc(ctx, c, out);
+            if (c == '[')
+            {
+                ctx->state = sw_regex_class;
+            }
+            else if (c == '\\')
+            {
+                ctx->state = sw_regex_escape;
+            }
+            break;
 
-                case '}':
-                case ']':
-                case ')':
-                case '+':
-                case '-':
-                case '"':
-                case '\'':
-                case '`':
-                    action(1, in, out);
-                    break;
-
-                default:
-                    action(isAlphanum(theA) ? 1 : 3, in, out);
-                }
+        case sw_regex_escape:
+        case sw_regex_class_escape:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theA = c;
+            if (c == EOF)
+            {
+                ctx->state = sw_regex_end;
                 break;
+            }
+            ngx_putc(ctx, c, out);
+            ctx->state = (ctx->state == sw_regex_escape) ? sw_regex : sw_regex_class;
+            break;
 
-            default:
-                action(1, in, out);
+        case sw_regex_class:
+            c = get(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theA = c;
+            if (c == EOF)
+            {
+                /* Unterminated set in Regular Expression literal. */
+                ctx->state = sw_regex_end;
                 break;
             }
+            ngx_putc(ctx, c, out);
+            if (c == ']')
+            {
+                ctx->state = sw_regex;
+            }
+            else if (c == '\\')
+            {
+                ctx->state = sw_regex_class_escape;
+            }
+            break;
+
+        case sw_regex_end:
+            c = next(ctx, in);
+            if (c == NGX_JSMIN_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+            ctx->theB = c;
+            dispatch(ctx, out);
+            break;
+
+        case sw_done:
+            return NGX_OK;
         }
     }
-
-    out->end = out->pos;
-    out->last = out->pos;
-    out->pos = out->start;
 }
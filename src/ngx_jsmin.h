@@ -1,3 +1,37 @@
-void jsmin(ngx_buf_t *in,ngx_buf_t *out);
+/* returned by the input reader when the current buffer is exhausted */
+#define NGX_JSMIN_AGAIN -2
+
+/* one step of the state machine never writes more than this */
+#define NGX_JSMIN_CARRY 4
+
+typedef struct
+{
+    int theA;
+    int theB;
+    int theLookahead;
+    int theX;
+    int theY;
+
+    ngx_uint_t state;
+    ngx_uint_t comment;
+    ngx_uint_t bom;
+
+    u_char carry[NGX_JSMIN_CARRY];
+    size_t ncarry;
+
+    /* input buffer of the current call, bounds the output when in place */
+    ngx_buf_t *in;
+
+    unsigned last : 1;
+    unsigned in_place : 1;
+} ngx_jsmin_ctx_t;
+
+ngx_jsmin_ctx_t *jsmin_create(ngx_pool_t *pool);
+
+void jsmin_resume(ngx_jsmin_ctx_t *ctx, int a);
+
+ngx_uint_t jsmin_resumable(ngx_jsmin_ctx_t *ctx, int a);
+
+ngx_int_t jsmin(ngx_jsmin_ctx_t *ctx, ngx_buf_t *in, ngx_buf_t *out);
 
 
@@ -0,0 +1,429 @@
+
+/*
+ * minify_thread_split 的回归测试：单线程一次压缩的输出是标准答案。
+ *
+ * 每个用例在每个字节处切成两段：前一段交给一个引擎（last 为 0），然后
+ *
+ *   - 这个引擎接着压缩后一段，输出必须和一次压缩的完全相同，这是合并时
+ *     核对失败、用前一段的引擎重做的路径；
+ *   - jsmin_resumable() / cssmin_resumable() 认为可以接上时，一个新引擎
+ *     （JavaScript 先 jsmin_resume()）压缩后一段，两段输出拼起来也必须
+ *     完全相同，这是各段并行压缩的路径。
+ *
+ * 用例里的 \001 标出必须能接上的切点（resume 的值按 ngx_http_minify_split()
+ * 的规则取），\002 标出必须接不上的切点：字符串、正则、模板、注释里面。
+ * 标记本身不属于输入。
+ *
+ * 不需要 nginx 源码，在仓库根目录：
+ *
+ *     cc -I test/split -I src -o minify_split test/split/minify_split.c \
+ *         src/ngx_jsmin.c src/ngx_cssmin.c
+ *     ./minify_split
+ *
+ * 输出是 TAP，有失败时退出码非 0。
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <stdio.h>
+#include "ngx_jsmin.h"
+#include "ngx_cssmin.h"
+
+#define MINIFY_JS 0
+#define MINIFY_CSS 1
+
+#define MINIFY_ACCEPT '\001'
+#define MINIFY_REJECT '\002'
+
+typedef struct
+{
+    int type;
+    const char *name;
+    const char *text;
+} minify_case_t;
+
+typedef struct
+{
+    int type;
+    ngx_jsmin_ctx_t *jsmin;
+    ngx_cssmin_ctx_t *cssmin;
+} minify_engine_t;
+
+static minify_case_t cases[] = {
+
+    {MINIFY_JS, "js statements and blocks",
+     "var a = 1;\n\001"
+     "function f(x) {\n"
+     "    if (x) {\n"
+     "        return x + 1;\n\001"
+     "    }\n\001"
+     "    return -x;\n\001"
+     "}\n\001"
+     "a = f(a) - -a;\n\001"
+     "b = a\n"
+     "++c;\n\001"
+     "var o = {\n"
+     "    k: {v: 1}\n\001"
+     ", w: 2};\n\001"
+     "f(o)\n"},
+
+    {MINIFY_JS, "js cuts in strings",
+     "var s = 'a;\\\n\002"
+     "b};\\\n\002"
+     "c';\n\001"
+     "var t = \"x }\\\n\002"
+     "y;\";\n\001"
+     "var e = 'it\\'s;\\\n\002"
+     "ok';\n"},
+
+    {MINIFY_JS, "js cuts in regexes",
+     "var r = /a;\002b}\002c/g;\n\001"
+     "var k = /[;}\002/]\002+/.test(s);\n\001"
+     "var m = /\\/\002;\\}\002/;\n\001"
+     "x = a / b;\n\001"
+     "y = (a) / 2 / c;\n"},
+
+    {MINIFY_JS, "js cuts in template literals",
+     "var t = `line one;\n\002"
+     "  line two }\n\002"
+     "${a + b};\n\002"
+     "done`;\n\001"
+     "var u = `${ f({a: 1}) }\n\002"
+     "`;\n\001"
+     "g(t, u);\n"},
+
+    {MINIFY_JS, "js cuts in comments",
+     "/* header;\n\002"
+     " * more }\n\002"
+     " */\n"
+     "var a = 1; // trailing;\n\001"
+     "// a whole line };\n"
+     "var b = 2;\n\001"
+     "/**/var c = 3; /* x;\n\002"
+     "}\n\002"
+     "*/\n"
+     "var d = a / b; /* q */\n"},
+
+    {MINIFY_JS, "js byte order mark",
+     "\xef\xbb\xbf" "var a = 1;\n\001"
+     "var b = '\xef\xbb\xbf;\\\n\002"
+     "';\n"},
+
+    {MINIFY_CSS, "css rules",
+     "body {\n"
+     "    color: red;\n"
+     "    margin: 0 auto;\n"
+     "}\n\001"
+     "a:hover , a:focus  {\n"
+     "    color : blue ;\n"
+     "}\n\001"
+     "@import url(x.css);\n"
+     "@media screen {\n"
+     "    p { font: 12px  serif }\n"
+     "}\n\001"
+     "div{}\n"},
+
+    {MINIFY_CSS, "css cuts in declarations and parens",
+     "a {\n"
+     "    color: red;\n\002"
+     "    background: url(data:image/png;base64,\002AAA}\n\002"
+     "BBB);\n\002"
+     "}\n\001"
+     "b { width: calc(1px + \0022px) }\n"},
+
+    {MINIFY_CSS, "css cuts in comments",
+     "/* a {}\n\002"
+     " b {}\n\002"
+     " */\n"
+     "c { color: red } /* d {\n\002"
+     "} */\n\001"
+     "e { margin: 0 }\n"},
+};
+
+static ngx_uint_t failed;
+
+/*
+ * 建一个新引擎，resume 不是 0 时是从 JavaScript 中间接着开始的引擎。
+ */
+static void
+minify_engine_init(minify_engine_t *e, int type, int resume)
+{
+    e->type = type;
+    e->jsmin = NULL;
+    e->cssmin = NULL;
+
+    if (type == MINIFY_CSS)
+    {
+        e->cssmin = cssmin_create(NULL);
+        return;
+    }
+
+    e->jsmin = jsmin_create(NULL);
+
+    if (resume)
+    {
+        jsmin_resume(e->jsmin, resume);
+    }
+}
+
+static void
+minify_engine_free(minify_engine_t *e)
+{
+    free(e->jsmin);
+    free(e->cssmin);
+}
+
+/*
+ * 把 [p, p + len) 交给引擎，输出接在 out->last 后面。out 总是足够大，
+ * 所以最后一段返回 NGX_OK，其他返回 NGX_AGAIN。
+ */
+static ngx_int_t
+minify_run(minify_engine_t *e, u_char *p, size_t len, int last, ngx_buf_t *out)
+{
+    ngx_buf_t in;
+
+    in.start = p;
+    in.pos = p;
+    in.last = p + len;
+    in.end = p + len;
+
+    if (e->type == MINIFY_CSS)
+    {
+        e->cssmin->last = last;
+        e->cssmin->in_place = 0;
+        return cssmin(e->cssmin, &in, out);
+    }
+
+    e->jsmin->last = last;
+    e->jsmin->in_place = 0;
+    return jsmin(e->jsmin, &in, out);
+}
+
+static ngx_uint_t
+minify_resumable(minify_engine_t *e, int resume)
+{
+    if (e->type == MINIFY_CSS)
+    {
+        return cssmin_resumable(e->cssmin);
+    }
+
+    return jsmin_resumable(e->jsmin, resume);
+}
+
+/*
+ * 切点前一行去掉行尾空白后以 ';' 结尾时 jsmin 还留着它作为 theA，
+ * 否则是换行，和 ngx_http_minify_split() 一致。
+ */
+static int
+minify_resume_at(u_char *start, u_char *p)
+{
+    if (p == start || p[-1] != '\n')
+    {
+        return '\n';
+    }
+
+    for (p--; p > start && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r'); p--)
+    {
+        /* void */
+    }
+
+    return (p > start && p[-1] == ';') ? ';' : '\n';
+}
+
+static void
+minify_fail(const char *name, const char *what, size_t cut, int resume)
+{
+    failed++;
+
+    printf("# %s: %s at byte %lu", name, what, (unsigned long)cut);
+
+    if (resume)
+    {
+        printf(" (resume %s)", resume == ';' ? "';'" : "'\\n'");
+    }
+
+    printf("\n");
+}
+
+/*
+ * 跑一个用例，返回 1 表示全部通过。
+ */
+static ngx_uint_t
+minify_case(minify_case_t *mc)
+{
+    int resume, resumes[2];
+    char mark[4096];
+    size_t len, cut, olen, nresumes;
+    u_char *src, *obuf, *abuf, *bbuf;
+    ngx_uint_t i, same[2], before, accepted;
+    ngx_buf_t full, a, b;
+    const char *t;
+    minify_engine_t e, first, next;
+
+    before = failed;
+
+    /* take the markers out of the input */
+
+    src = malloc(strlen(mc->text) + 1);
+    len = 0;
+
+    memset(mark, 0, sizeof(mark));
+
+    for (t = mc->text; *t; t++)
+    {
+        if (*t == MINIFY_ACCEPT || *t == MINIFY_REJECT)
+        {
+            mark[len] = *t;
+            continue;
+        }
+
+        if (len == sizeof(mark) - 1)
+        {
+            printf("# %s: too long\n", mc->name);
+            free(src);
+            return 0;
+        }
+
+        src[len++] = *t;
+    }
+
+    /* the engines never write more than what they have read, plus a carry */
+
+    olen = 2 * len + 64;
+    obuf = malloc(olen);
+    abuf = malloc(olen);
+    bbuf = malloc(olen);
+
+    full.start = obuf;
+    full.pos = obuf;
+    full.last = obuf;
+    full.end = obuf + olen;
+
+    minify_engine_init(&e, mc->type, 0);
+
+    if (minify_run(&e, src, len, 1, &full) != NGX_OK)
+    {
+        minify_fail(mc->name, "one pass did not finish", len, 0);
+    }
+
+    minify_engine_free(&e);
+
+    if (mc->type == MINIFY_CSS)
+    {
+        resumes[0] = 0;
+        nresumes = 1;
+    }
+    else
+    {
+        resumes[0] = '\n';
+        resumes[1] = ';';
+        nresumes = 2;
+    }
+
+    for (cut = 1; cut < len; cut++)
+    {
+        a.start = abuf;
+        a.pos = abuf;
+        a.last = abuf;
+        a.end = abuf + olen;
+
+        minify_engine_init(&first, mc->type, 0);
+
+        if (minify_run(&first, src, cut, 0, &a) != NGX_AGAIN)
+        {
+            minify_fail(mc->name, "first piece finished early", cut, 0);
+            minify_engine_free(&first);
+            continue;
+        }
+
+        for (i = 0; i < nresumes; i++)
+        {
+            same[i] = minify_resumable(&first, resumes[i]);
+        }
+
+        /* a cut the engine accepts must give the one pass output */
+
+        for (i = 0; i < nresumes; i++)
+        {
+            if (!same[i])
+            {
+                continue;
+            }
+
+            b.start = bbuf;
+            b.pos = bbuf;
+            b.last = ngx_cpymem(bbuf, a.pos, a.last - a.pos);
+            b.end = bbuf + olen;
+
+            minify_engine_init(&next, mc->type, resumes[i]);
+
+            if (minify_run(&next, src + cut, len - cut, 1, &b) != NGX_OK
+                || b.last - b.pos != full.last - full.pos
+                || memcmp(b.pos, full.pos, b.last - b.pos) != 0)
+            {
+                minify_fail(mc->name, "accepted cut changes the output", cut, resumes[i]);
+            }
+
+            minify_engine_free(&next);
+        }
+
+        /* the markers */
+
+        if (mark[cut] == MINIFY_ACCEPT)
+        {
+            resume = (mc->type == MINIFY_CSS) ? 0 : minify_resume_at(src, src + cut);
+            accepted = (mc->type == MINIFY_CSS || resume == '\n') ? same[0] : same[1];
+
+            if (!accepted)
+            {
+                minify_fail(mc->name, "cut not accepted", cut, resume);
+            }
+        }
+        else if (mark[cut] == MINIFY_REJECT)
+        {
+            for (i = 0; i < nresumes; i++)
+            {
+                if (same[i])
+                {
+                    minify_fail(mc->name, "cut accepted", cut, resumes[i]);
+                }
+            }
+        }
+
+        /* the first engine going on over the rest, as when a cut is redone */
+
+        if (minify_run(&first, src + cut, len - cut, 1, &a) != NGX_OK
+            || a.last - a.pos != full.last - full.pos
+            || memcmp(a.pos, full.pos, a.last - a.pos) != 0)
+        {
+            minify_fail(mc->name, "two buffers differ from one", cut, 0);
+        }
+
+        minify_engine_free(&first);
+    }
+
+    free(src);
+    free(obuf);
+    free(abuf);
+    free(bbuf);
+
+    return failed == before;
+}
+
+int
+main(void)
+{
+    ngx_uint_t i, n;
+
+    n = sizeof(cases) / sizeof(cases[0]);
+
+    printf("1..%lu\n", (unsigned long)n);
+
+    for (i = 0; i < n; i++)
+    {
+        printf("%s %lu - %s\n", minify_case(&cases[i]) ? "ok" : "not ok",
+               (unsigned long)(i + 1), cases[i].name);
+    }
+
+    return failed ? 1 : 0;
+}
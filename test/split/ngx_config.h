@@ -0,0 +1,19 @@
+
+/*
+ * Just enough of nginx to build ngx_jsmin.c and ngx_cssmin.c on their own,
+ * see minify_split.c.
+ */
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef intptr_t ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
@@ -0,0 +1,34 @@
+
+/*
+ * Just enough of nginx to build ngx_jsmin.c and ngx_cssmin.c on their own,
+ * see minify_split.c.
+ */
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+typedef unsigned char u_char;
+typedef void ngx_pool_t;
+
+typedef struct
+{
+    u_char *pos;
+    u_char *last;
+    u_char *start;
+    u_char *end;
+} ngx_buf_t;
+
+#define NGX_OK 0
+#define NGX_ERROR -1
+#define NGX_AGAIN -2
+#define NGX_BUSY -3
+
+#define ngx_min(val1, val2) ((val1 > val2) ? (val2) : (val1))
+#define ngx_memcpy(dst, src, n) (void)memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n) (((u_char *)memcpy(dst, src, n)) + (n))
+#define ngx_memmove(dst, src, n) (void)memmove(dst, src, n)
+
+/* the engines only allocate their context, the driver frees it */
+#define ngx_pcalloc(pool, size) calloc(1, size)
+
+#endif /* _NGX_CORE_H_INCLUDED_ */